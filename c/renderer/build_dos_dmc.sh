@@ -6,11 +6,15 @@ SOURCE_FILES="
 src/main.c
 src/renderer/renderer.c
 src/renderer/polygon.c
+src/renderer/framesink.c
 src/common/file.c
 src/common/genstack.c
+src/common/timer.c
 src/assets/mesh.c
 src/assets/texture.c
 src/assets/ground.c
+src/assets/groundchunks.c
+src/assets/assetcache.c
 "
 
 wine "$DMC_PATH/bin/dmc.exe" $SOURCE_FILES $BUILD_OPTIONS -Isrc/ -I$DMC_PATH/include
@@ -2,11 +2,15 @@ SOURCE_FILES="
 src/main.c
 src/renderer/renderer.c
 src/renderer/polygon.c
+src/renderer/framesink.c
 src/common/file.c
 src/common/genstack.c
+src/common/timer.c
 src/assets/mesh.c
 src/assets/texture.c
 src/assets/ground.c
+src/assets/groundchunks.c
+src/assets/assetcache.c
 "
 
-gcc -std=c99 -g -pedantic -Wall -Isrc/ $SOURCE_FILES -o bin/renderer -lm -lSDL2
+gcc -std=c99 -g -pedantic -Wall -Isrc/ $SOURCE_FILES -o bin/renderer -lm -lSDL2 -pthread
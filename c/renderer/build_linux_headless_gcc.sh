@@ -0,0 +1,16 @@
+SOURCE_FILES="
+src/main.c
+src/renderer/renderer.c
+src/renderer/polygon.c
+src/renderer/framesink.c
+src/common/file.c
+src/common/genstack.c
+src/common/timer.c
+src/assets/mesh.c
+src/assets/texture.c
+src/assets/ground.c
+src/assets/groundchunks.c
+src/assets/assetcache.c
+"
+
+gcc -std=c99 -g -pedantic -Wall -Isrc/ $SOURCE_FILES -DRENDER_HEADLESS -o bin/renderer_headless -lm -pthread
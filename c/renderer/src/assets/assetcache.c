@@ -0,0 +1,475 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ *
+ * Software: Render test for replicating Rally-Sport's rendering.
+ *
+ * A cache of the assets decoded from the game's files, so that they needn't be
+ * decoded again on each run. The cache is a single file of sections, one per
+ * kind of asset, written ("baked") by the asset modules from the assets they've
+ * decoded. On later runs, the file is mapped into memory and the modules take
+ * their assets from it as they are, only turning the offsets stored in their
+ * pointer fields into pointers.
+ *
+ * The cache records the size and modification time of each of the game's asset
+ * files it was baked from, and is baked anew if any of them have changed. Each
+ * section has a checksum, verified when the section is first asked for, so
+ * that only the sections in use need to be read through. A section that fails
+ * its checksum is loaded from the game's files instead, and the cache is
+ * deleted so that it gets baked anew on the next run.
+ *
+ * The cache isn't used in DOS, where its sections would exceed the 64 KB
+ * allocation limit.
+ *
+ */
+
+#if !MSDOS
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "common/file.h"
+#include "assets/assetcache.h"
+#include "assets/texture.h"
+#include "assets/mesh.h"
+#include "assets/ground.h"
+#include "renderer/renderer.h"
+
+#if !MSDOS
+    #define ASSET_CACHE 1
+#else
+    #define ASSET_CACHE 0
+#endif
+
+// For the process id that keeps a bake's temporary file apart from those of
+// other processes baking at the same time.
+#if ASSET_CACHE
+    #ifdef _WIN32
+        #include <process.h>
+        #define getpid _getpid
+    #else
+        #include <unistd.h>
+    #endif
+#else
+    // Nothing is baked in DOS.
+    #define getpid() 0
+#endif
+
+#define CACHE_FILENAME "ASSETS.CCH"
+
+// Incremented whenever the format of the cache or of its sections changes, or
+// what's baked into them does.
+#define CACHE_VERSION 3
+
+#define CACHE_MAGIC 0x43415352l // "RSAC".
+
+// The number of tracks, as far as the cache is concerned.
+#define NUM_TRACKS (KASSETCACHE_NUM_SECTIONS - KASSETCACHE_TRACKS)
+
+// The game's files the cache is baked from: RALLYE.EXE, TEXT1.DTA, PALAT.001,
+// and each track's MAASTO and VARIMAA.
+#define NUM_SOURCE_FILES (3 + (2 * NUM_TRACKS))
+
+struct source_stamp_s
+{
+    int64_t mtime; // -1 if the file doesn't exist.
+    uint32_t size;
+    uint32_t pad;
+};
+
+struct cache_header_s
+{
+    uint32_t magic;
+    uint32_t version;
+
+    // The sizes of the structures cached as they are in memory, which differ
+    // between compilers and platforms.
+    uint32_t layout;
+
+    // The number of bytes from PAYLOAD_OFFS on.
+    uint32_t payloadSize;
+
+    struct source_stamp_s sources[NUM_SOURCE_FILES];
+
+    // Offsets are in bytes from PAYLOAD_OFFS.
+    struct
+    {
+        uint32_t offset;
+        uint32_t size;
+        uint32_t checksum;
+    } sections[KASSETCACHE_NUM_SECTIONS];
+};
+
+// Where in the cache file the sections begin. Aligned so that data aligned
+// within the payload are aligned in memory too, the file being mapped on a
+// page boundary.
+#define PAYLOAD_OFFS ((sizeof(struct cache_header_s) + PAYLOAD_ALIGNMENT - 1) & ~(PAYLOAD_ALIGNMENT - 1))
+#define PAYLOAD_ALIGNMENT 64
+
+static struct kfile_mapping_s CACHE_MAPPING;
+static int CACHE_IS_OPEN = 0;
+static uint8_t *CACHE_PAYLOAD;
+static const struct cache_header_s *CACHE_HEADER;
+static int SECTION_IS_VERIFIED[KASSETCACHE_NUM_SECTIONS];
+static int SECTION_IS_RELOCATED[KASSETCACHE_NUM_SECTIONS];
+
+// The cache being baked.
+static uint8_t *BAKE_BUFFER;
+static uint32_t BAKE_SIZE;
+static uint32_t BAKE_CAPACITY;
+static struct cache_header_s BAKE_HEADER;
+static int BAKE_SECTION = -1;
+
+static void source_filename(char *const filename, const unsigned sourceIdx)
+{
+    switch (sourceIdx)
+    {
+        case 0: sprintf(filename, "RALLYE.EXE"); break;
+        case 1: sprintf(filename, "TEXT1.DTA"); break;
+        case 2: sprintf(filename, "PALAT.001"); break;
+        default:
+        {
+            const unsigned trackIdx = ((sourceIdx - 3) / 2);
+            sprintf(filename, (((sourceIdx - 3) % 2)? "VARIMAA.00%c" : "MAASTO.00%c"), ('1' + trackIdx));
+            break;
+        }
+    }
+
+    return;
+}
+
+static struct source_stamp_s source_stamp(const unsigned sourceIdx)
+{
+    struct source_stamp_s stamp;
+    struct stat fileStat;
+    char filename[20];
+
+    source_filename(filename, sourceIdx);
+    memset(&stamp, 0, sizeof(stamp));
+
+    if (stat(filename, &fileStat) == 0)
+    {
+        stamp.mtime = fileStat.st_mtime;
+        stamp.size = fileStat.st_size;
+    }
+    else
+    {
+        stamp.mtime = -1;
+    }
+
+    return stamp;
+}
+
+static uint32_t layout_stamp(void)
+{
+    return (sizeof(struct texture_s) |
+            (sizeof(struct polygon_s) << 8) |
+            (sizeof(struct mesh_s) << 16) |
+            (sizeof(void*) << 24));
+}
+
+// FNV-1a, a 32-bit word at a time, over four interleaved lanes so that the
+// multiplications needn't wait on each other. The data's size must be a
+// multiple of 8, as the sections' sizes are.
+static uint32_t checksum(const uint8_t *const data, const uint32_t numBytes)
+{
+    uint32_t hash[4] = {2166136261ul, 2166136261ul, 2166136261ul, 2166136261ul};
+    uint32_t i = 0;
+
+    for (; (i + 16) <= numBytes; i += 16)
+    {
+        uint32_t words[4];
+        memcpy(words, &data[i], 16);
+
+        hash[0] = ((hash[0] ^ words[0]) * 16777619ul);
+        hash[1] = ((hash[1] ^ words[1]) * 16777619ul);
+        hash[2] = ((hash[2] ^ words[2]) * 16777619ul);
+        hash[3] = ((hash[3] ^ words[3]) * 16777619ul);
+    }
+
+    for (; i < numBytes; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, &data[i], 4);
+
+        hash[0] = ((hash[0] ^ word) * 16777619ul);
+    }
+
+    return (hash[0] ^ (hash[1] * 3) ^ (hash[2] * 5) ^ (hash[3] * 7));
+}
+
+// Maps the cache file, if it exists and is up to date. Returns true on success.
+static int map_cache(void)
+{
+    struct stat fileStat;
+
+    if ((stat(CACHE_FILENAME, &fileStat) != 0) ||
+        (fileStat.st_size < (long)PAYLOAD_OFFS))
+    {
+        return 0;
+    }
+
+    CACHE_MAPPING = kfile_map_file_private(CACHE_FILENAME, 0, KFILE_REST_OF_FILE);
+    CACHE_HEADER = (const struct cache_header_s*)CACHE_MAPPING.data;
+    CACHE_PAYLOAD = ((uint8_t*)CACHE_MAPPING.base + PAYLOAD_OFFS);
+
+    if ((CACHE_HEADER->magic != CACHE_MAGIC) ||
+        (CACHE_HEADER->version != CACHE_VERSION) ||
+        (CACHE_HEADER->layout != layout_stamp()) ||
+        (CACHE_HEADER->payloadSize != (CACHE_MAPPING.size - PAYLOAD_OFFS)))
+    {
+        kfile_unmap_file(&CACHE_MAPPING);
+        return 0;
+    }
+
+    for (unsigned i = 0; i < NUM_SOURCE_FILES; i++)
+    {
+        const struct source_stamp_s stamp = source_stamp(i);
+
+        if ((stamp.mtime != CACHE_HEADER->sources[i].mtime) ||
+            (stamp.size != CACHE_HEADER->sources[i].size))
+        {
+            kfile_unmap_file(&CACHE_MAPPING);
+            return 0;
+        }
+    }
+
+    for (unsigned i = 0; i < KASSETCACHE_NUM_SECTIONS; i++)
+    {
+        if ((CACHE_HEADER->sections[i].offset > CACHE_HEADER->payloadSize) ||
+            (CACHE_HEADER->sections[i].size > (CACHE_HEADER->payloadSize - CACHE_HEADER->sections[i].offset)))
+        {
+            kfile_unmap_file(&CACHE_MAPPING);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Decodes the assets from the game's files and writes them into the cache
+// file. Returns true on success.
+static int bake_cache(void)
+{
+    memset(&BAKE_HEADER, 0, sizeof(BAKE_HEADER));
+    BAKE_HEADER.magic = CACHE_MAGIC;
+    BAKE_HEADER.version = CACHE_VERSION;
+    BAKE_HEADER.layout = layout_stamp();
+
+    for (unsigned i = 0; i < NUM_SOURCE_FILES; i++)
+    {
+        BAKE_HEADER.sources[i] = source_stamp(i);
+
+        // The game's data files must all exist, though the tracks needn't.
+        if ((i < 3) && (BAKE_HEADER.sources[i].mtime < 0))
+        {
+            return 0;
+        }
+    }
+
+    BAKE_SIZE = 0;
+    BAKE_CAPACITY = 0;
+    BAKE_BUFFER = NULL;
+
+    ktexture_initialize_textures();
+    kmesh_initialize_meshes();
+
+    ktexture_bake_cache();
+    kmesh_bake_cache();
+    krender_bake_palettes();
+
+    for (unsigned i = 0; i < NUM_TRACKS; i++)
+    {
+        if ((BAKE_HEADER.sources[3 + (i * 2)].mtime >= 0) &&
+            (BAKE_HEADER.sources[3 + (i * 2) + 1].mtime >= 0))
+        {
+            kground_bake_cache(i);
+        }
+    }
+
+    kmesh_release_meshes();
+    ktexture_release_textures();
+
+    BAKE_SECTION = -1;
+    BAKE_HEADER.payloadSize = BAKE_SIZE;
+
+    for (unsigned i = 0; i < KASSETCACHE_NUM_SECTIONS; i++)
+    {
+        BAKE_HEADER.sections[i].checksum = checksum(&BAKE_BUFFER[BAKE_HEADER.sections[i].offset], BAKE_HEADER.sections[i].size);
+    }
+
+    // Write into a temporary file first, so that an interrupted bake doesn't
+    // leave behind a broken cache. The file is named after this process, so
+    // that processes baking at the same time don't write into the same one.
+    {
+        char tempFilename[32];
+        sprintf(tempFilename, (CACHE_FILENAME "~%lu"), (unsigned long)getpid());
+
+        FILE *const file = fopen(tempFilename, "wb");
+        int success = (file != NULL);
+
+        if (success)
+        {
+            static const uint8_t padding[PAYLOAD_OFFS - sizeof(BAKE_HEADER) + 1];
+
+            success = ((fwrite(&BAKE_HEADER, sizeof(BAKE_HEADER), 1, file) == 1) &&
+                       (fwrite(padding, 1, (PAYLOAD_OFFS - sizeof(BAKE_HEADER)), file) == (PAYLOAD_OFFS - sizeof(BAKE_HEADER))) &&
+                       (!BAKE_SIZE || (fwrite(BAKE_BUFFER, BAKE_SIZE, 1, file) == 1)));
+            success = ((fclose(file) == 0) && success);
+        }
+
+        free(BAKE_BUFFER);
+        BAKE_BUFFER = NULL;
+
+        if (!success ||
+            (rename(tempFilename, CACHE_FILENAME) != 0))
+        {
+            remove(tempFilename);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void kassetcache_open(void)
+{
+    #if ASSET_CACHE
+        assert(!CACHE_IS_OPEN && "The asset cache is already open.");
+
+        CACHE_IS_OPEN = (map_cache() || (bake_cache() && map_cache()));
+
+        for (unsigned i = 0; i < KASSETCACHE_NUM_SECTIONS; i++)
+        {
+            SECTION_IS_VERIFIED[i] = 0;
+            SECTION_IS_RELOCATED[i] = 0;
+        }
+    #endif
+
+    return;
+}
+
+void kassetcache_close(void)
+{
+    if (CACHE_IS_OPEN)
+    {
+        kfile_unmap_file(&CACHE_MAPPING);
+        CACHE_IS_OPEN = 0;
+    }
+
+    return;
+}
+
+uint8_t* kassetcache_section(const unsigned sectionIdx, uint32_t *const numBytes)
+{
+    assert((sectionIdx < KASSETCACHE_NUM_SECTIONS) && "Asset cache section index out of bounds.");
+
+    if (!CACHE_IS_OPEN ||
+        !CACHE_HEADER->sections[sectionIdx].size)
+    {
+        return NULL;
+    }
+
+    if (!SECTION_IS_VERIFIED[sectionIdx])
+    {
+        if (checksum((CACHE_PAYLOAD + CACHE_HEADER->sections[sectionIdx].offset),
+                     CACHE_HEADER->sections[sectionIdx].size) != CACHE_HEADER->sections[sectionIdx].checksum)
+        {
+            remove(CACHE_FILENAME);
+            return NULL;
+        }
+
+        SECTION_IS_VERIFIED[sectionIdx] = 1;
+    }
+
+    if (numBytes)
+    {
+        *numBytes = CACHE_HEADER->sections[sectionIdx].size;
+    }
+
+    return (CACHE_PAYLOAD + CACHE_HEADER->sections[sectionIdx].offset);
+}
+
+int kassetcache_mark_relocated(const unsigned sectionIdx)
+{
+    const int wasRelocated = SECTION_IS_RELOCATED[sectionIdx];
+
+    SECTION_IS_RELOCATED[sectionIdx] = 1;
+
+    return wasRelocated;
+}
+
+// Grows the bake buffer, if need be, to hold at least the given number of bytes,
+// and zeroes the bytes from the end of what's been baked so far up to that
+// number, so the cache's contents (and checksum) don't depend on uninitialized
+// memory. Returns the new size of the bake.
+static uint32_t grow_bake(const uint32_t newSize)
+{
+    if (newSize > BAKE_CAPACITY)
+    {
+        BAKE_CAPACITY = ((newSize > (BAKE_CAPACITY * 2))? newSize : (BAKE_CAPACITY * 2));
+        BAKE_BUFFER = realloc(BAKE_BUFFER, BAKE_CAPACITY);
+
+        assert(BAKE_BUFFER && "Failed to allocate memory for the asset cache.");
+    }
+
+    if (newSize > BAKE_SIZE)
+    {
+        memset(&BAKE_BUFFER[BAKE_SIZE], 0, (newSize - BAKE_SIZE));
+    }
+
+    return newSize;
+}
+
+void kassetcache_begin_section(const unsigned sectionIdx)
+{
+    assert((sectionIdx < KASSETCACHE_NUM_SECTIONS) && "Asset cache section index out of bounds.");
+
+    // Sections begin aligned to PAYLOAD_ALIGNMENT, so data in them can be
+    // aligned up to that.
+    BAKE_SIZE = grow_bake((BAKE_SIZE + PAYLOAD_ALIGNMENT - 1) & ~(PAYLOAD_ALIGNMENT - 1ul));
+    BAKE_SECTION = sectionIdx;
+    BAKE_HEADER.sections[sectionIdx].offset = BAKE_SIZE;
+    BAKE_HEADER.sections[sectionIdx].size = 0;
+
+    return;
+}
+
+uint32_t kassetcache_write(const void *const data, const uint32_t numBytes)
+{
+    return kassetcache_write_aligned(data, numBytes, 8);
+}
+
+uint32_t kassetcache_write_aligned(const void *const data, const uint32_t numBytes, const uint32_t alignment)
+{
+    assert((BAKE_SECTION >= 0) && "No asset cache section is being written.");
+    assert(alignment && !(alignment & (alignment - 1)) && (alignment <= PAYLOAD_ALIGNMENT) &&
+           "Asset cache data can only be aligned to a power of two up to the payload's alignment.");
+
+    const uint32_t sectionStart = BAKE_HEADER.sections[BAKE_SECTION].offset;
+    const uint32_t offset = (((BAKE_SIZE - sectionStart) + alignment - 1) & ~(alignment - 1));
+    const uint32_t newSize = (sectionStart + ((offset + numBytes + 7) & ~7ul));
+
+    BAKE_SIZE = grow_bake(newSize);
+    memcpy(&BAKE_BUFFER[sectionStart + offset], data, numBytes);
+
+    BAKE_HEADER.sections[BAKE_SECTION].size = (BAKE_SIZE - sectionStart);
+
+    return offset;
+}
+
+void kassetcache_overwrite(const uint32_t offset, const void *const data, const uint32_t numBytes)
+{
+    assert((BAKE_SECTION >= 0) && "No asset cache section is being written.");
+
+    const uint32_t sectionStart = BAKE_HEADER.sections[BAKE_SECTION].offset;
+
+    assert(((offset + numBytes) <= BAKE_HEADER.sections[BAKE_SECTION].size) && "Overwriting past the end of the asset cache section.");
+
+    memcpy(&BAKE_BUFFER[sectionStart + offset], data, numBytes);
+
+    return;
+}
@@ -0,0 +1,69 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ *
+ * Software: Render test for replicating Rally-Sport's rendering.
+ *
+ */
+
+#ifndef ASSET_CACHE_H
+#define ASSET_CACHE_H
+
+#include <stdint.h>
+
+// The sections of the asset cache, each holding one kind of decoded asset data.
+// The sections' contents are defined by the modules that write and read them.
+enum
+{
+    KASSETCACHE_PROP_TEXTURES,
+    KASSETCACHE_PALA_TEXTURES,
+    KASSETCACHE_PROP_MESHES,
+    KASSETCACHE_PALETTES,
+
+    // One section per track; the track with ground index n is in section
+    // KASSETCACHE_TRACKS + n.
+    KASSETCACHE_TRACKS,
+
+    // Must be the last item in the list.
+    KASSETCACHE_NUM_SECTIONS = (KASSETCACHE_TRACKS + 8)
+};
+
+// Cached data refer to other data in the same section by their byte offset in
+// the section. These convert between such an offset, stored in a pointer field,
+// and the pointer.
+#define KASSETCACHE_OFFSET_AS_POINTER(offset) ((void*)(uintptr_t)(offset))
+#define KASSETCACHE_RELOCATE(pointer, section) ((void*)((uint8_t*)(section) + (uintptr_t)(pointer)))
+
+// Opens the asset cache in the current directory, first baking it from the
+// game's asset files if it doesn't exist or if the asset files have changed
+// since it was baked. Must be called before the assets are initialized. If the
+// cache can't be used, the assets will be loaded from the game's files.
+void kassetcache_open(void);
+
+void kassetcache_close(void);
+
+// Returns the given section's data, which may be modified (e.g. to relocate
+// pointers), or NULL if the cache isn't open or the section is empty. If
+// numBytes isn't NULL, it's set to the size of the data.
+uint8_t* kassetcache_section(const unsigned sectionIdx, uint32_t *const numBytes);
+
+// Returns true if the given section's data have been relocated, and marks them
+// so. The data are only relocated once per opening of the cache, however many
+// times they're loaded.
+int kassetcache_mark_relocated(const unsigned sectionIdx);
+
+// While baking, starts writing the given section. Sections are written one at
+// a time.
+void kassetcache_begin_section(const unsigned sectionIdx);
+
+// While baking, appends the given data to the current section, and returns
+// their byte offset in the section. Appended data are aligned to 8 bytes.
+uint32_t kassetcache_write(const void *const data, const uint32_t numBytes);
+
+// Like kassetcache_write(), but aligns the data to the given power of two, up
+// to 64 bytes.
+uint32_t kassetcache_write_aligned(const void *const data, const uint32_t numBytes, const uint32_t alignment);
+
+// While baking, overwrites data previously appended to the current section.
+void kassetcache_overwrite(const uint32_t offset, const void *const data, const uint32_t numBytes);
+
+#endif
@@ -10,17 +10,37 @@
  * The view is realized as a set of polygonal meshes, returned by
  * kground_ground_meshes().
  * 
+ * Tracks wider than GROUND_MAX_WHOLE_TRACK_WIDTH tiles have their heightmap
+ * and tilemap streamed from disk in chunks around the view (see
+ * groundchunks.c) rather than loaded whole.
+ * 
+ * The view is double-buffered: the next view can be requested with
+ * kground_request_ground_mesh() and is then built on a worker thread, where
+ * threads are available (i.e. not in DOS), while the current one is drawn.
+ * kground_swap_ground_mesh() hands the new view over once it's been built.
+ * 
  */
 
 #include <assert.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "common/genstack.h"
 #include "common/file.h"
 #include "renderer/vector.h"
 #include "renderer/renderer.h"
 #include "assets/ground.h"
 #include "assets/mesh.h"
+#include "assets/groundchunks.h"
+#include "assets/assetcache.h"
+
+#if !MSDOS
+    #include <pthread.h>
+
+    #define GROUND_BUILDER_THREAD 1
+#else
+    #define GROUND_BUILDER_THREAD 0
+#endif
 
 struct track_prop_s
 {
@@ -33,10 +53,23 @@ struct track_prop_s
 #define GROUND_VIEW_WIDTH 23
 #define GROUND_VIEW_HEIGHT 24
 
+// Tracks up to this wide, in tiles, are loaded whole; wider ones are streamed.
+#ifndef GROUND_MAX_WHOLE_TRACK_WIDTH
+    #define GROUND_MAX_WHOLE_TRACK_WIDTH 128
+#endif
+
+// How many tiles around the ground view to have the heightmap and tilemap of a
+// streamed track loaded for, so that scrolling finds them in memory.
+#define GROUND_PREFETCH_MARGIN 16
+
 // The dimensions, in world units, of a single tile in the surface mesh.
 #define SURFACE_MESH_TILE_WIDTH 128
 #define SURFACE_MESH_TILE_HEIGHT 128
 
+// Whether the track's heightmap and tilemap are streamed rather than held in
+// HEIGHTMAP and TILEMAP.
+static int TRACK_IS_STREAMED;
+
 // The height value of each corner point in the surface mesh.
 static int16_t *HEIGHTMAP;
 static unsigned HEIGHTMAP_WIDTH; // In tile units.
@@ -47,17 +80,107 @@ static uint8_t *TILEMAP;
 static unsigned TILEMAP_WIDTH; // In tile units.
 static unsigned TILEMAP_HEIGHT;
 
-// The meshes that constitute the ground view.
-static struct kelpo_generic_stack_s *GROUND_VIEW_MESHES;
+// What's drawn at a surface tile, as far as it depends only on the track's
+// data. Worked out for each of the track's tiles at load, so that building the
+// ground view doesn't have to. The textures are indices into PALA_TEXTURES,
+// which keeps the records small enough to stream through the cache.
+struct tile_record_s
+{
+    uint8_t texture;
+    uint8_t billboardTexture; // 0 if the tile has no billboard.
+    uint8_t isBridge; // The billboard lies flat at ground level.
+};
+
+// The PALA textures by index, as returned by ktexture_pala_texture(). Filled in
+// for each index a tile record refers to as the record is made.
+static struct texture_s *PALA_TEXTURES[256];
+
+// The records of the track's tiles, including the row and column one past the
+// tilemap's far edges, which the view can reach. NULL if there wasn't memory
+// for them.
+static struct tile_record_s *TILE_RECORDS;
+static int TILE_RECORDS_WIDTH;
+static int TILE_RECORDS_HEIGHT;
+
+// A surface tile and the billboard tile (e.g. a spectator) standing on it, if
+// any.
+struct surface_tile_s
+{
+    struct polygon_s ground;
+    struct polygon_s billboard;
+    int hasBillboard;
+};
+
+// A ground view's meshes and the surface tiles they refer to. There are two of
+// these, so that the next view can be built while the current one is drawn.
+struct ground_view_s
+{
+    // The meshes that constitute the view.
+    struct kelpo_generic_stack_s *meshes;
+
+    // The surface tiles in the view, kept as a ring buffer so that when the
+    // view scrolls, only the tiles coming into view need to be built: a track
+    // tile's slot is at its coordinates modulo the view's size. The ring holds
+    // the view whose top left tile is at tileRingX/Z.
+    struct surface_tile_s *tileRing;
+    int tileRingX;
+    int tileRingZ;
+    int tileRingIsValid;
+
+    // The surface mesh's polygons in drawing order, copied from the ring.
+    struct polygon_s *surfacePolys;
+    unsigned numSurfacePolys;
+};
+
+static struct ground_view_s GROUND_VIEWS[2];
+
+// The index in GROUND_VIEWS of the view whose meshes kground_ground_meshes()
+// returns. The other view is the one that's built next.
+static unsigned CURRENT_GROUND_VIEW = 0;
 
-// Pre-allocated memory for building the surface mesh into.
-static struct polygon_s *SURFACE_MESH_POLY_CACHE;
+// Set while a view requested with kground_request_ground_mesh() is waiting to
+// be swapped in.
+static int GROUND_VIEW_IS_REQUESTED = 0;
 
 // All props on the given Rally-Sport track. Note that only those props that are
 // visible in the current view will be included with its meshes.
-#define MAX_NUM_PROPS 14 // How many props a track can have, at most.
 static uint16_t NUM_PROPS = 0; // How many props this track has. Must be a 2-byte variable.
-static struct track_prop_s* PROPS[MAX_NUM_PROPS];
+static struct track_prop_s *PROPS;
+
+// The track's props bucketed by position into squares of PROP_BUCKET_SIZE
+// world units, so that building the ground view only needs to look at the
+// props near it. The props of bucket n are listed in PROP_BUCKET_PROPS from
+// index PROP_BUCKET_STARTS[n] up to PROP_BUCKET_STARTS[n + 1], in the order in
+// which they appear in the track's data. Buckets are numbered row by row, the
+// rows running away from the viewer (along the track's negative Z).
+#define PROP_BUCKET_SIZE (4 * SURFACE_MESH_TILE_WIDTH)
+static unsigned PROP_BUCKETS_WIDTH;
+static unsigned PROP_BUCKETS_HEIGHT;
+static uint32_t *PROP_BUCKET_STARTS;
+static uint16_t *PROP_BUCKET_PROPS;
+
+// Whether the track's heightmap, tilemap, tile records and props are in the
+// asset cache rather than loaded from the game's files.
+static int TRACK_IS_CACHED = 0;
+
+// The layout of a track's section in the asset cache. The offsets are from the
+// start of the section; a track that's streamed has only its props cached, and
+// one without tile records has a tileRecordsOffs of 0.
+struct cached_track_s
+{
+    uint32_t width;
+    uint32_t numProps;
+    uint32_t heightmapOffs;
+    uint32_t tilemapOffs;
+    uint32_t tileRecordsOffs;
+    uint32_t propsOffs;
+
+    // Which PALA textures the tile records refer to.
+    uint8_t usedTextures[256];
+};
+
+// Scratch space for collecting the props in view.
+static uint16_t *VISIBLE_PROPS;
 
 // The vertices of the ground view meshes will be offset by this amount on the
 // XYZ axes, so as to properly center them on the screen when rendered.
@@ -67,13 +190,15 @@ static struct vector_s GROUND_VIEW_SCREEN_OFFSET = {-(((GROUND_VIEW_WIDTH / 2) -
 
 // Convenience macro for querying the heightmap's value at the given XY
 // coordinates, with bounds-checking on the coordinate values.
-#define HEIGHT_AT(x, y) (((x) < 0) || ((x) > HEIGHTMAP_WIDTH) ||\
-                         ((y) < 0) || ((y) >= HEIGHTMAP_HEIGHT))? 0 : -HEIGHTMAP[(x) + (y) * HEIGHTMAP_WIDTH]
+#define HEIGHT_AT(x, y) (TRACK_IS_STREAMED? -kgroundchunks_height_at((x), (y)) :\
+                         ((((x) < 0) || ((x) >= HEIGHTMAP_WIDTH) ||\
+                           ((y) < 0) || ((y) >= HEIGHTMAP_HEIGHT))? 0 : -HEIGHTMAP[(x) + (y) * HEIGHTMAP_WIDTH]))
 
 // Convenience macro for querying the tilemap's value at the given XY
 // coordinates, with bounds-checking on the coordinate values.
-#define TILE_AT(x, y)   (((x) < 0) || ((x) > HEIGHTMAP_WIDTH) ||\
-                         ((y) < 0) || ((y) >= HEIGHTMAP_HEIGHT))? 0 : TILEMAP[(x) + (y) * HEIGHTMAP_WIDTH]
+#define TILE_AT(x, y)   (TRACK_IS_STREAMED? kgroundchunks_tile_at((x), (y)) :\
+                         ((((x) < 0) || ((x) >= HEIGHTMAP_WIDTH) ||\
+                           ((y) < 0) || ((y) >= HEIGHTMAP_HEIGHT))? 0 : TILEMAP[(x) + (y) * HEIGHTMAP_WIDTH]))
 
 // Figures out which spectator billboard texture should be drawn at the given
 // track tile coordinates.
@@ -108,248 +233,647 @@ int kground_height(void)
 
 const struct kelpo_generic_stack_s* kground_ground_meshes(void)
 {
-    return GROUND_VIEW_MESHES;
+    return GROUND_VIEWS[CURRENT_GROUND_VIEW].meshes;
 }
 
-void kground_update_ground_mesh(const int viewOffsX, const int viewOffsZ)
+// Works out what's drawn at the surface tile at the given track tile
+// coordinates.
+static void make_tile_record(struct tile_record_s *const record, const int tileX, const int tileY)
 {
-    kelpo_generic_stack__clear(GROUND_VIEW_MESHES);
+    const unsigned palaIdx = TILE_AT(tileX, (tileY - 1));
+    unsigned billboardPalaIdx = 0;
 
-    // Add surface tiles.
+    switch (palaIdx)
     {
-        unsigned numPolys = 0;
+        // Spectators.
+        case 240:
+        case 241:
+        case 242: billboardPalaIdx = spectator_billboard_idx(tileX, (tileY - 1)); break;
+
+        // Shrubs.
+        case 243: billboardPalaIdx = 208; break;
+        case 244: billboardPalaIdx = 209; break;
+        case 245: billboardPalaIdx = 210; break;
+
+        // Small poles.
+        case 246:
+        case 247: billboardPalaIdx = 211; break;
+        case 250: billboardPalaIdx = 212; break;
+
+        // Bridge.
+        case 248:
+        case 249: billboardPalaIdx = 177; break;
+
+        // No billboard.
+        default: break;
+    }
 
-        for (int z = 0; z < GROUND_VIEW_HEIGHT; z++)
-        {
-            for (int x = 0; x < GROUND_VIEW_WIDTH; x++)
-            {
-                const int tileX = (x + viewOffsX);
-                const int tileY = (z + viewOffsZ);
+    PALA_TEXTURES[palaIdx] = ktexture_pala_texture(palaIdx);
+    PALA_TEXTURES[billboardPalaIdx] = ktexture_pala_texture(billboardPalaIdx);
 
-                // Center the mesh on screen.
-                const int vertX = ((x * SURFACE_MESH_TILE_WIDTH) + GROUND_VIEW_SCREEN_OFFSET.x);
-                const int vertZ = ((-z * SURFACE_MESH_TILE_HEIGHT) + GROUND_VIEW_SCREEN_OFFSET.z);
+    record->texture = palaIdx;
+    record->billboardTexture = billboardPalaIdx;
+    record->isBridge = (billboardPalaIdx == 177);
 
-                struct polygon_s *const groundPoly = &SURFACE_MESH_POLY_CACHE[numPolys++];
+    return;
+}
 
-                // Back left.
-                groundPoly->verts[0].x = vertX;
-                groundPoly->verts[0].y = HEIGHT_AT(tileX, tileY);
-                groundPoly->verts[0].z = vertZ;
+// Returns the record of the surface tile at the given track tile coordinates.
+// Tiles outside the track, or all tiles if there was no memory for the
+// records, have their record worked out into the given scratch space.
+static const struct tile_record_s* tile_record(struct tile_record_s *const scratch, const int tileX, const int tileY)
+{
+    if (TILE_RECORDS &&
+        (tileX >= 0) && (tileX < TILE_RECORDS_WIDTH) &&
+        (tileY >= 0) && (tileY < TILE_RECORDS_HEIGHT))
+    {
+        return &TILE_RECORDS[tileX + (tileY * TILE_RECORDS_WIDTH)];
+    }
 
-                // Back right.
-                groundPoly->verts[1].x = (vertX + SURFACE_MESH_TILE_WIDTH);
-                groundPoly->verts[1].y = HEIGHT_AT((tileX + 1), tileY);
-                groundPoly->verts[1].z = vertZ;
+    make_tile_record(scratch, tileX, tileY);
 
-                // Front left.
-                groundPoly->verts[2].x = vertX;
-                groundPoly->verts[2].y = HEIGHT_AT(tileX, (tileY - 1));
-                groundPoly->verts[2].z = (vertZ + SURFACE_MESH_TILE_HEIGHT);
+    return scratch;
+}
 
-                // Front right.
-                groundPoly->verts[3].x = (vertX + SURFACE_MESH_TILE_WIDTH);
-                groundPoly->verts[3].y = HEIGHT_AT((tileX + 1), (tileY - 1));
-                groundPoly->verts[3].z = (vertZ + SURFACE_MESH_TILE_HEIGHT);
+// Builds into the given ring slot the surface tile at the given track tile
+// coordinates, along with its billboard tile, if any. The tile's vertices are
+// in absolute track coordinates; the ground view mesh's position moves them
+// into view.
+static void build_surface_tile(struct surface_tile_s *const tile, const int tileX, const int tileY)
+{
+    const int vertX = (tileX * SURFACE_MESH_TILE_WIDTH);
+    const int vertZ = (-tileY * SURFACE_MESH_TILE_HEIGHT);
+    struct polygon_s *const groundPoly = &tile->ground;
 
-                const unsigned palaIdx = TILE_AT(tileX, (tileY - 1));
-                groundPoly->texture = ktexture_pala_texture(palaIdx);
+    // Back left.
+    groundPoly->verts[0].x = vertX;
+    groundPoly->verts[0].y = HEIGHT_AT(tileX, tileY);
+    groundPoly->verts[0].z = vertZ;
 
-                // Add a billboard tile, if any.
-                {
-                    unsigned billboardPalaIdx = 0;
+    // Back right.
+    groundPoly->verts[1].x = (vertX + SURFACE_MESH_TILE_WIDTH);
+    groundPoly->verts[1].y = HEIGHT_AT((tileX + 1), tileY);
+    groundPoly->verts[1].z = vertZ;
 
-                    switch (palaIdx)
-                    {
-                        // Spectators.
-                        case 240:
-                        case 241:
-                        case 242: billboardPalaIdx = spectator_billboard_idx(tileX, (tileY - 1)); break;
-
-                        // Shrubs.
-                        case 243: billboardPalaIdx = 208; break;
-                        case 244: billboardPalaIdx = 209; break;
-                        case 245: billboardPalaIdx = 210; break;
-
-                        // Small poles.
-                        case 246:
-                        case 247: billboardPalaIdx = 211; break;
-                        case 250: billboardPalaIdx = 212; break;
-
-                        // Bridge.
-                        case 248:
-                        case 249: billboardPalaIdx = 177; break;
-
-                        // No billboard.
-                        default: break;
-                    }
+    // Front left.
+    groundPoly->verts[2].x = vertX;
+    groundPoly->verts[2].y = HEIGHT_AT(tileX, (tileY - 1));
+    groundPoly->verts[2].z = (vertZ + SURFACE_MESH_TILE_HEIGHT);
 
-                    if (billboardPalaIdx)
-                    {
-                        struct polygon_s *const billboardPoly = &SURFACE_MESH_POLY_CACHE[numPolys++];
-                        const int height = HEIGHT_AT(tileX, tileY);
-
-                        // Bridge tile.
-                        if (billboardPalaIdx == 177)
-                        {
-                            // Back left.
-                            billboardPoly->verts[0].x = vertX;
-                            billboardPoly->verts[0].y = 0;
-                            billboardPoly->verts[0].z = vertZ;
-
-                            // Back right.
-                            billboardPoly->verts[1].x = (vertX + SURFACE_MESH_TILE_WIDTH);
-                            billboardPoly->verts[1].y = 0;
-                            billboardPoly->verts[1].z = vertZ;
-
-                            // Front left.
-                            billboardPoly->verts[2].x = vertX;
-                            billboardPoly->verts[2].y = 0;
-                            billboardPoly->verts[2].z = (vertZ + SURFACE_MESH_TILE_HEIGHT);
-
-                            // Front right.
-                            billboardPoly->verts[3].x = (vertX + SURFACE_MESH_TILE_WIDTH);
-                            billboardPoly->verts[3].y = 0;
-                            billboardPoly->verts[3].z = (vertZ + SURFACE_MESH_TILE_HEIGHT);
-                        }
-                        // Other billboards.
-                        else
-                        {
-                            // Top left.
-                            billboardPoly->verts[0].x = vertX;
-                            billboardPoly->verts[0].y = (height - SURFACE_MESH_TILE_HEIGHT);
-                            billboardPoly->verts[0].z = vertZ;
-
-                            // Top right.
-                            billboardPoly->verts[1].x = (vertX + SURFACE_MESH_TILE_WIDTH);
-                            billboardPoly->verts[1].y = (height - SURFACE_MESH_TILE_HEIGHT);
-                            billboardPoly->verts[1].z = vertZ;
-
-                            // Bottom left.
-                            billboardPoly->verts[2].x = vertX;
-                            billboardPoly->verts[2].y = height;
-                            billboardPoly->verts[2].z = vertZ;
-
-                            // Bottom right.
-                            billboardPoly->verts[3].x = (vertX + SURFACE_MESH_TILE_WIDTH);
-                            billboardPoly->verts[3].y = height;
-                            billboardPoly->verts[3].z = vertZ;
-                        }
-
-                        billboardPoly->texture = ktexture_pala_texture(billboardPalaIdx);
-                    }
-                }
+    // Front right.
+    groundPoly->verts[3].x = (vertX + SURFACE_MESH_TILE_WIDTH);
+    groundPoly->verts[3].y = HEIGHT_AT((tileX + 1), (tileY - 1));
+    groundPoly->verts[3].z = (vertZ + SURFACE_MESH_TILE_HEIGHT);
+
+    struct tile_record_s recordScratch;
+    const struct tile_record_s *const record = tile_record(&recordScratch, tileX, tileY);
+
+    groundPoly->texture = PALA_TEXTURES[record->texture];
+
+    // Add a billboard tile, if any.
+    tile->hasBillboard = (record->billboardTexture != 0);
+
+    if (record->billboardTexture)
+    {
+        struct polygon_s *const billboardPoly = &tile->billboard;
+        const int height = HEIGHT_AT(tileX, tileY);
+
+        // Bridge tile.
+        if (record->isBridge)
+        {
+            // Back left.
+            billboardPoly->verts[0].x = vertX;
+            billboardPoly->verts[0].y = 0;
+            billboardPoly->verts[0].z = vertZ;
+
+            // Back right.
+            billboardPoly->verts[1].x = (vertX + SURFACE_MESH_TILE_WIDTH);
+            billboardPoly->verts[1].y = 0;
+            billboardPoly->verts[1].z = vertZ;
+
+            // Front left.
+            billboardPoly->verts[2].x = vertX;
+            billboardPoly->verts[2].y = 0;
+            billboardPoly->verts[2].z = (vertZ + SURFACE_MESH_TILE_HEIGHT);
+
+            // Front right.
+            billboardPoly->verts[3].x = (vertX + SURFACE_MESH_TILE_WIDTH);
+            billboardPoly->verts[3].y = 0;
+            billboardPoly->verts[3].z = (vertZ + SURFACE_MESH_TILE_HEIGHT);
+        }
+        // Other billboards.
+        else
+        {
+            // Top left.
+            billboardPoly->verts[0].x = vertX;
+            billboardPoly->verts[0].y = (height - SURFACE_MESH_TILE_HEIGHT);
+            billboardPoly->verts[0].z = vertZ;
+
+            // Top right.
+            billboardPoly->verts[1].x = (vertX + SURFACE_MESH_TILE_WIDTH);
+            billboardPoly->verts[1].y = (height - SURFACE_MESH_TILE_HEIGHT);
+            billboardPoly->verts[1].z = vertZ;
+
+            // Bottom left.
+            billboardPoly->verts[2].x = vertX;
+            billboardPoly->verts[2].y = height;
+            billboardPoly->verts[2].z = vertZ;
+
+            // Bottom right.
+            billboardPoly->verts[3].x = (vertX + SURFACE_MESH_TILE_WIDTH);
+            billboardPoly->verts[3].y = height;
+            billboardPoly->verts[3].z = vertZ;
+        }
+
+        billboardPoly->texture = PALA_TEXTURES[record->billboardTexture];
+    }
+
+    return;
+}
+
+// Returns the slot in the given view's ring that holds the surface tile at the
+// given track tile coordinates while the tile is in view.
+static struct surface_tile_s* surface_tile_slot(const struct ground_view_s *const view,
+                                                const int tileX,
+                                                const int tileY)
+{
+    const int ringX = (((tileX % GROUND_VIEW_WIDTH) + GROUND_VIEW_WIDTH) % GROUND_VIEW_WIDTH);
+    const int ringY = (((tileY % GROUND_VIEW_HEIGHT) + GROUND_VIEW_HEIGHT) % GROUND_VIEW_HEIGHT);
+
+    return &view->tileRing[ringX + (ringY * GROUND_VIEW_WIDTH)];
+}
+
+// Brings the given view's surface tile ring up to date with a view whose top
+// left tile is at the given track tile coordinates, building only the tiles
+// that weren't in the previous view. Returns true if the set of tiles in view
+// changed.
+static int scroll_surface_tiles(struct ground_view_s *const view,
+                                const int viewTileX,
+                                const int viewTileZ)
+{
+    const int dx = (viewTileX - view->tileRingX);
+    const int dz = (viewTileZ - view->tileRingZ);
+
+    if (view->tileRingIsValid && !dx && !dz)
+    {
+        return 0;
+    }
+
+    for (int z = viewTileZ; z < (viewTileZ + GROUND_VIEW_HEIGHT); z++)
+    {
+        const int isRowInRing = (view->tileRingIsValid &&
+                                 (z >= view->tileRingZ) &&
+                                 (z < (view->tileRingZ + GROUND_VIEW_HEIGHT)));
+
+        for (int x = viewTileX; x < (viewTileX + GROUND_VIEW_WIDTH); x++)
+        {
+            // Rows already in the ring only need their newly exposed columns.
+            if (isRowInRing &&
+                (x >= view->tileRingX) &&
+                (x < (view->tileRingX + GROUND_VIEW_WIDTH)))
+            {
+                x = ((view->tileRingX + GROUND_VIEW_WIDTH) - 1);
+                continue;
             }
+
+            build_surface_tile(surface_tile_slot(view, x, z), x, z);
         }
+    }
 
-        struct mesh_s heightmapMesh;
+    view->tileRingX = viewTileX;
+    view->tileRingZ = viewTileZ;
+    view->tileRingIsValid = 1;
+
+    return 1;
+}
 
-        heightmapMesh.x = heightmapMesh.y = heightmapMesh.z = 0;
-        heightmapMesh.numPolys = numPolys;
-        heightmapMesh.polys = SURFACE_MESH_POLY_CACHE;
+// Returns the index of the prop bucket row or column that contains the given
+// world distance along it, clamped to the given number of rows or columns.
+static int prop_bucket_coord(const float distance, const unsigned numBuckets)
+{
+    const int bucket = floor(distance / PROP_BUCKET_SIZE);
 
-        kelpo_generic_stack__push_copy(GROUND_VIEW_MESHES, &heightmapMesh);
+    return ((bucket < 0)? 0 : (bucket >= (int)numBuckets)? ((int)numBuckets - 1) : bucket);
+}
+
+// Sorts the track's props into the buckets of the spatial index.
+static void build_prop_buckets(void)
+{
+    unsigned maxBucketX = 0, maxBucketZ = 0;
+
+    for (unsigned i = 0; i < NUM_PROPS; i++)
+    {
+        const unsigned bucketX = (PROPS[i].position.x / PROP_BUCKET_SIZE);
+        const unsigned bucketZ = (-PROPS[i].position.z / PROP_BUCKET_SIZE);
+
+        if (bucketX > maxBucketX) maxBucketX = bucketX;
+        if (bucketZ > maxBucketZ) maxBucketZ = bucketZ;
     }
 
-    // Add props.
+    PROP_BUCKETS_WIDTH = (maxBucketX + 1);
+    PROP_BUCKETS_HEIGHT = (maxBucketZ + 1);
+    PROP_BUCKET_STARTS = calloc(((PROP_BUCKETS_WIDTH * PROP_BUCKETS_HEIGHT) + 1), sizeof(*PROP_BUCKET_STARTS));
+    PROP_BUCKET_PROPS = malloc(sizeof(*PROP_BUCKET_PROPS) * (NUM_PROPS + 1));
+    VISIBLE_PROPS = malloc(sizeof(*VISIBLE_PROPS) * (NUM_PROPS + 1));
+
+    assert((PROP_BUCKET_STARTS && PROP_BUCKET_PROPS && VISIBLE_PROPS) && "Failed to allocate memory for the prop index.");
+
+    // Count the props in each bucket (bucket n's count going in entry n + 1),
+    // sum the counts into start indices, then place the props.
     for (unsigned i = 0; i < NUM_PROPS; i++)
     {
-        const int meshX = (PROPS[i]->position.x - ((viewOffsX * SURFACE_MESH_TILE_WIDTH) - GROUND_VIEW_SCREEN_OFFSET.x));
-        const int meshZ = (PROPS[i]->position.z + (viewOffsZ * SURFACE_MESH_TILE_HEIGHT) + GROUND_VIEW_SCREEN_OFFSET.z);
-        const int meshY = (PROPS[i]->position.y
-                           ? PROPS[i]->position.y
-                           : HEIGHT_AT(((int)PROPS[i]->position.x / SURFACE_MESH_TILE_WIDTH), (-(int)PROPS[i]->position.z / SURFACE_MESH_TILE_HEIGHT)));
-        
-        // If the prop isn't within the view frustum, don't add it.
-        if ((meshZ > (GROUND_VIEW_SCREEN_OFFSET.z + (1 * SURFACE_MESH_TILE_HEIGHT))) ||
-            (meshZ < (GROUND_VIEW_SCREEN_OFFSET.z - ((GROUND_VIEW_HEIGHT + 3) * SURFACE_MESH_TILE_HEIGHT))) ||
-            (meshX < (GROUND_VIEW_SCREEN_OFFSET.x - (3 * SURFACE_MESH_TILE_WIDTH))) ||
-            (meshX > (GROUND_VIEW_SCREEN_OFFSET.x + ((GROUND_VIEW_WIDTH + 3) * SURFACE_MESH_TILE_WIDTH))))
+        const unsigned bucketIdx = ((PROPS[i].position.x / PROP_BUCKET_SIZE) +
+                                    ((unsigned)(-PROPS[i].position.z / PROP_BUCKET_SIZE) * PROP_BUCKETS_WIDTH));
+
+        PROP_BUCKET_STARTS[bucketIdx + 1]++;
+    }
+
+    for (unsigned i = 1; i <= (PROP_BUCKETS_WIDTH * PROP_BUCKETS_HEIGHT); i++)
+    {
+        PROP_BUCKET_STARTS[i] += PROP_BUCKET_STARTS[i - 1];
+    }
+
+    {
+        uint32_t *const nextSlot = malloc(sizeof(*nextSlot) * PROP_BUCKETS_WIDTH * PROP_BUCKETS_HEIGHT);
+
+        assert(nextSlot && "Failed to allocate memory for the prop index.");
+
+        memcpy(nextSlot, PROP_BUCKET_STARTS, (sizeof(*nextSlot) * PROP_BUCKETS_WIDTH * PROP_BUCKETS_HEIGHT));
+
+        for (unsigned i = 0; i < NUM_PROPS; i++)
         {
-            continue;
-        }
+            const unsigned bucketIdx = ((PROPS[i].position.x / PROP_BUCKET_SIZE) +
+                                        ((unsigned)(-PROPS[i].position.z / PROP_BUCKET_SIZE) * PROP_BUCKETS_WIDTH));
 
-        struct mesh_s propMesh = kmesh_prop_mesh(PROPS[i]->type, meshX, meshY, meshZ);
+            PROP_BUCKET_PROPS[nextSlot[bucketIdx]++] = i;
+        }
 
-        kelpo_generic_stack__push_copy(GROUND_VIEW_MESHES, &propMesh);
+        free(nextSlot);
     }
 
     return;
 }
 
-void kground_initialize_ground(const unsigned groundIdx)
+// Builds the given view's meshes to show the track from the given offset, in
+// tiles (see kground_update_ground_mesh()).
+static void build_ground_view(struct ground_view_s *const view,
+                              const float viewOffsX,
+                              const float viewOffsZ)
 {
-    assert((groundIdx <= 8) && "Ground index out of bounds.");
+    const int viewTileX = floor(viewOffsX);
+    const int viewTileZ = floor(viewOffsZ);
 
-    GROUND_VIEW_MESHES = kelpo_generic_stack__create((MAX_NUM_PROPS + 1), sizeof(struct mesh_s));
+    kelpo_generic_stack__clear(view->meshes);
 
-    // Pre-allocate memory for as many surface polygons as we're going to need
-    // at most. Since each surface tile (a quad polygon) can optionally have a
-    // billboard tile (e.g. a spectator), we need to allocate twice the size
-    // of the ground view.
+    // Have the track data around the view loaded ahead of its being needed.
+    // The view's tiles reach one row in front of the view and one column to
+    // its right.
+    if (TRACK_IS_STREAMED)
     {
-        const unsigned maxNumSurfacePolys = (2 * GROUND_VIEW_WIDTH * GROUND_VIEW_HEIGHT);
-
-        SURFACE_MESH_POLY_CACHE = malloc(sizeof(*SURFACE_MESH_POLY_CACHE) * maxNumSurfacePolys);
+        kgroundchunks_prefetch((viewTileX - GROUND_PREFETCH_MARGIN),
+                               (viewTileZ - 1 - GROUND_PREFETCH_MARGIN),
+                               (viewTileX + GROUND_VIEW_WIDTH + GROUND_PREFETCH_MARGIN),
+                               (viewTileZ + GROUND_VIEW_HEIGHT + GROUND_PREFETCH_MARGIN));
+    }
 
-        for (unsigned i = 0; i < maxNumSurfacePolys; i++)
+    // Add surface tiles. If the view has moved onto different tiles, we list
+    // the ring's tiles (and their billboards) in the view's back-to-front,
+    // left-to-right order; the polygons themselves only need building for
+    // tiles that have scrolled into view.
+    {
+        if (scroll_surface_tiles(view, viewTileX, viewTileZ))
         {
-            SURFACE_MESH_POLY_CACHE[i] = kpolygon_create_polygon(4);
+            view->numSurfacePolys = 0;
+
+            for (int z = viewTileZ; z < (viewTileZ + GROUND_VIEW_HEIGHT); z++)
+            {
+                for (int x = viewTileX; x < (viewTileX + GROUND_VIEW_WIDTH); x++)
+                {
+                    const struct surface_tile_s *const tile = surface_tile_slot(view, x, z);
+
+                    view->surfacePolys[view->numSurfacePolys++] = tile->ground;
+
+                    if (tile->hasBillboard)
+                    {
+                        view->surfacePolys[view->numSurfacePolys++] = tile->billboard;
+                    }
+                }
+            }
         }
+
+        // The tiles' vertices are in track coordinates, so moving the mesh by
+        // the view's offset centers the view on screen. Motion within a tile
+        // only changes this position.
+        struct mesh_s heightmapMesh;
+
+        heightmapMesh.x = (GROUND_VIEW_SCREEN_OFFSET.x - (viewOffsX * SURFACE_MESH_TILE_WIDTH));
+        heightmapMesh.y = 0;
+        heightmapMesh.z = (GROUND_VIEW_SCREEN_OFFSET.z + (viewOffsZ * SURFACE_MESH_TILE_HEIGHT));
+        heightmapMesh.numPolys = view->numSurfacePolys;
+        heightmapMesh.polys = view->surfacePolys;
+        heightmapMesh.numVerts = 0;
+        heightmapMesh.verts = NULL;
+        heightmapMesh.hasBounds = 0; // Covers the whole view; not worth testing.
+
+        kelpo_generic_stack__push_copy(view->meshes, &heightmapMesh);
     }
 
-    // Import the Rally-Sport heightmap.
+    // Add props. Only the props in the buckets overlapping the view's prop
+    // area are considered.
     {
-        char filename[20];
-        sprintf(filename, "MAASTO.00%c", ('1' + groundIdx));
+        const float minX = ((viewOffsX * SURFACE_MESH_TILE_WIDTH) - (3 * SURFACE_MESH_TILE_WIDTH));
+        const float maxX = ((viewOffsX * SURFACE_MESH_TILE_WIDTH) + ((GROUND_VIEW_WIDTH + 3) * SURFACE_MESH_TILE_WIDTH));
+        const float minZ = ((viewOffsZ * SURFACE_MESH_TILE_HEIGHT) - (1 * SURFACE_MESH_TILE_HEIGHT));
+        const float maxZ = ((viewOffsZ * SURFACE_MESH_TILE_HEIGHT) + ((GROUND_VIEW_HEIGHT + 3) * SURFACE_MESH_TILE_HEIGHT));
+        const int firstBucketX = prop_bucket_coord(minX, PROP_BUCKETS_WIDTH);
+        const int lastBucketX = prop_bucket_coord(maxX, PROP_BUCKETS_WIDTH);
+        const int firstBucketZ = prop_bucket_coord(minZ, PROP_BUCKETS_HEIGHT);
+        const int lastBucketZ = prop_bucket_coord(maxZ, PROP_BUCKETS_HEIGHT);
+        unsigned numVisibleProps = 0;
+
+        for (int bz = firstBucketZ; bz <= lastBucketZ; bz++)
+        {
+            for (int bx = firstBucketX; bx <= lastBucketX; bx++)
+            {
+                const unsigned bucketIdx = (bx + (bz * PROP_BUCKETS_WIDTH));
+
+                for (uint32_t b = PROP_BUCKET_STARTS[bucketIdx]; b < PROP_BUCKET_STARTS[bucketIdx + 1]; b++)
+                {
+                    const struct track_prop_s *const prop = &PROPS[PROP_BUCKET_PROPS[b]];
+                    const float meshX = (prop->position.x - ((viewOffsX * SURFACE_MESH_TILE_WIDTH) - GROUND_VIEW_SCREEN_OFFSET.x));
+                    const float meshZ = (prop->position.z + (viewOffsZ * SURFACE_MESH_TILE_HEIGHT) + GROUND_VIEW_SCREEN_OFFSET.z);
+
+                    // If the prop isn't within the view frustum, don't add it.
+                    if ((meshZ > (GROUND_VIEW_SCREEN_OFFSET.z + (1 * SURFACE_MESH_TILE_HEIGHT))) ||
+                        (meshZ < (GROUND_VIEW_SCREEN_OFFSET.z - ((GROUND_VIEW_HEIGHT + 3) * SURFACE_MESH_TILE_HEIGHT))) ||
+                        (meshX < (GROUND_VIEW_SCREEN_OFFSET.x - (3 * SURFACE_MESH_TILE_WIDTH))) ||
+                        (meshX > (GROUND_VIEW_SCREEN_OFFSET.x + ((GROUND_VIEW_WIDTH + 3) * SURFACE_MESH_TILE_WIDTH))))
+                    {
+                        continue;
+                    }
 
-        const file_handle_t maastoHandle = kfile_open_file(filename, "rb");
+                    VISIBLE_PROPS[numVisibleProps++] = PROP_BUCKET_PROPS[b];
+                }
+            }
+        }
 
-        HEIGHTMAP_WIDTH = HEIGHTMAP_HEIGHT = sqrt(kfile_file_size(maastoHandle) / 2);
-        assert(((HEIGHTMAP_WIDTH == 64) || (HEIGHTMAP_WIDTH == 128)) && "Unsupported heightmap dimensions.");
+        // Draw the props in the order in which they appear in the track's
+        // data, regardless of which buckets they came from.
+        for (unsigned i = 1; i < numVisibleProps; i++)
+        {
+            const uint16_t propIdx = VISIBLE_PROPS[i];
+            unsigned j = i;
 
-        HEIGHTMAP = malloc(sizeof(*HEIGHTMAP) * HEIGHTMAP_WIDTH * HEIGHTMAP_HEIGHT);
+            for (; (j > 0) && (VISIBLE_PROPS[j - 1] > propIdx); j--)
+            {
+                VISIBLE_PROPS[j] = VISIBLE_PROPS[j - 1];
+            }
+
+            VISIBLE_PROPS[j] = propIdx;
+        }
 
-        for (unsigned i = 0; i < (HEIGHTMAP_WIDTH * HEIGHTMAP_HEIGHT); i++)
+        for (unsigned i = 0; i < numVisibleProps; i++)
         {
-            uint8_t word[2];
+            const struct track_prop_s *const prop = &PROPS[VISIBLE_PROPS[i]];
+            const float meshX = (prop->position.x - ((viewOffsX * SURFACE_MESH_TILE_WIDTH) - GROUND_VIEW_SCREEN_OFFSET.x));
+            const float meshZ = (prop->position.z + (viewOffsZ * SURFACE_MESH_TILE_HEIGHT) + GROUND_VIEW_SCREEN_OFFSET.z);
+            struct mesh_s propMesh = kmesh_prop_mesh(prop->type, meshX, prop->position.y, meshZ);
 
-            kfile_read_byte_array(word, 2, maastoHandle);
+            kelpo_generic_stack__push_copy(view->meshes, &propMesh);
+        }
+    }
+    return;
+}
 
-            // More than -255 below ground level.
-            if (word[1] == 1)            
+#if GROUND_BUILDER_THREAD
+    static pthread_t GROUND_BUILDER;
+    static int GROUND_BUILDER_IS_RUNNING = 0;
+
+    // Guards the build request state below.
+    static pthread_mutex_t GROUND_BUILD_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+    // Signaled when a view has been requested of the builder, and when the
+    // builder has finished building it.
+    static pthread_cond_t GROUND_BUILD_REQUESTED = PTHREAD_COND_INITIALIZER;
+    static pthread_cond_t GROUND_BUILD_DONE = PTHREAD_COND_INITIALIZER;
+
+    // The view being built (NULL while no build is pending) and its offset.
+    static struct ground_view_s *GROUND_BUILD_VIEW = NULL;
+    static float GROUND_BUILD_OFFS_X;
+    static float GROUND_BUILD_OFFS_Z;
+    static int GROUND_BUILDER_QUIT = 0;
+
+    // Builds the requested views. Building a view reads the track's data and
+    // the prop meshes and textures, and writes only the view being built and
+    // the ground's own build state; it mustn't call into the renderer, whose
+    // state belongs to the thread drawing the current view.
+    static void* ground_builder(void *const unused)
+    {
+        (void)unused;
+
+        for (;;)
+        {
+            pthread_mutex_lock(&GROUND_BUILD_MUTEX);
+            while (!GROUND_BUILD_VIEW && !GROUND_BUILDER_QUIT)
             {
-                HEIGHTMAP[i] = (-256 - word[0]);
+                pthread_cond_wait(&GROUND_BUILD_REQUESTED, &GROUND_BUILD_MUTEX);
             }
-            // Above ground when word[1] == 255, otherwise below ground level.
-            else                    
+            struct ground_view_s *const view = GROUND_BUILD_VIEW;
+            const float viewOffsX = GROUND_BUILD_OFFS_X;
+            const float viewOffsZ = GROUND_BUILD_OFFS_Z;
+            pthread_mutex_unlock(&GROUND_BUILD_MUTEX);
+
+            // A pending build is always finished before the builder is told to
+            // quit (see wait_for_ground_build()).
+            if (!view)
             {
-                HEIGHTMAP[i] = (word[1] - word[0]);
+                break;
             }
+
+            build_ground_view(view, viewOffsX, viewOffsZ);
+
+            pthread_mutex_lock(&GROUND_BUILD_MUTEX);
+            GROUND_BUILD_VIEW = NULL;
+            pthread_cond_signal(&GROUND_BUILD_DONE);
+            pthread_mutex_unlock(&GROUND_BUILD_MUTEX);
+        }
+
+        return NULL;
+    }
+
+    static void wait_for_ground_build(void)
+    {
+        pthread_mutex_lock(&GROUND_BUILD_MUTEX);
+        while (GROUND_BUILD_VIEW)
+        {
+            pthread_cond_wait(&GROUND_BUILD_DONE, &GROUND_BUILD_MUTEX);
+        }
+        pthread_mutex_unlock(&GROUND_BUILD_MUTEX);
+
+        return;
+    }
+
+    static void stop_ground_builder(void)
+    {
+        if (GROUND_BUILDER_IS_RUNNING)
+        {
+            wait_for_ground_build();
+
+            pthread_mutex_lock(&GROUND_BUILD_MUTEX);
+            GROUND_BUILDER_QUIT = 1;
+            pthread_cond_signal(&GROUND_BUILD_REQUESTED);
+            pthread_mutex_unlock(&GROUND_BUILD_MUTEX);
+
+            pthread_join(GROUND_BUILDER, NULL);
+
+            GROUND_BUILDER_QUIT = 0;
+            GROUND_BUILDER_IS_RUNNING = 0;
         }
 
-        kfile_close_file(maastoHandle);
+        return;
     }
+#endif
+
+void kground_update_ground_mesh(const float viewOffsX, const float viewOffsZ)
+{
+    assert(!GROUND_VIEW_IS_REQUESTED && "A requested ground view is yet to be swapped in.");
+
+    build_ground_view(&GROUND_VIEWS[!CURRENT_GROUND_VIEW], viewOffsX, viewOffsZ);
+    CURRENT_GROUND_VIEW = !CURRENT_GROUND_VIEW;
+
+    return;
+}
+
+void kground_request_ground_mesh(const float viewOffsX, const float viewOffsZ)
+{
+    struct ground_view_s *const view = &GROUND_VIEWS[!CURRENT_GROUND_VIEW];
+
+    assert(!GROUND_VIEW_IS_REQUESTED && "A requested ground view is yet to be swapped in.");
+
+    GROUND_VIEW_IS_REQUESTED = 1;
+
+    #if GROUND_BUILDER_THREAD
+        if (!GROUND_BUILDER_IS_RUNNING)
+        {
+            GROUND_BUILDER_IS_RUNNING = (pthread_create(&GROUND_BUILDER, NULL, ground_builder, NULL) == 0);
+        }
 
-    // Import the Rally-Sport tilemap.
+        if (GROUND_BUILDER_IS_RUNNING)
+        {
+            pthread_mutex_lock(&GROUND_BUILD_MUTEX);
+            GROUND_BUILD_VIEW = view;
+            GROUND_BUILD_OFFS_X = viewOffsX;
+            GROUND_BUILD_OFFS_Z = viewOffsZ;
+            pthread_cond_signal(&GROUND_BUILD_REQUESTED);
+            pthread_mutex_unlock(&GROUND_BUILD_MUTEX);
+
+            return;
+        }
+    #endif
+
+    // Without a builder thread, the view is built here and now.
+    build_ground_view(view, viewOffsX, viewOffsZ);
+
+    return;
+}
+
+void kground_swap_ground_mesh(void)
+{
+    assert(GROUND_VIEW_IS_REQUESTED && "No ground view has been requested.");
+
+    #if GROUND_BUILDER_THREAD
+        wait_for_ground_build();
+    #endif
+
+    CURRENT_GROUND_VIEW = !CURRENT_GROUND_VIEW;
+    GROUND_VIEW_IS_REQUESTED = 0;
+
+    return;
+}
+
+// Loads the given track's heightmap, tilemap and props from the game's files.
+static void load_track(const unsigned groundIdx)
+{
+    // Import the Rally-Sport heightmap and tilemap. Tracks too wide to load
+    // whole are streamed instead.
     {
-        char filename[20];
-        sprintf(filename, "VARIMAA.00%c", ('1' + groundIdx));
+        char maastoFilename[20];
+        char varimaaFilename[20];
+        sprintf(maastoFilename, "MAASTO.00%c", ('1' + groundIdx));
+        sprintf(varimaaFilename, "VARIMAA.00%c", ('1' + groundIdx));
 
-        const file_handle_t varimaaHandle = kfile_open_file(filename, "rb");
-        assert((sqrt(kfile_file_size(varimaaHandle)) == HEIGHTMAP_WIDTH) && "Invalid tilemap dimensions.");
+        const file_handle_t maastoHandle = kfile_open_file(maastoFilename, "rb");
+        const uint32_t maastoSize = kfile_file_size(maastoHandle);
 
+        HEIGHTMAP_WIDTH = HEIGHTMAP_HEIGHT = sqrt(maastoSize / 2);
         TILEMAP_WIDTH = HEIGHTMAP_WIDTH;
         TILEMAP_HEIGHT = HEIGHTMAP_HEIGHT;
-        TILEMAP = malloc(TILEMAP_WIDTH * TILEMAP_HEIGHT);
-        kfile_read_byte_array(TILEMAP, (TILEMAP_WIDTH * TILEMAP_HEIGHT), varimaaHandle);
+        TRACK_IS_STREAMED = (HEIGHTMAP_WIDTH > GROUND_MAX_WHOLE_TRACK_WIDTH);
+
+        if (TRACK_IS_STREAMED)
+        {
+            assert(((2 * HEIGHTMAP_WIDTH * HEIGHTMAP_HEIGHT) == maastoSize) && "Unsupported heightmap dimensions.");
+
+            kfile_close_file(maastoHandle);
 
-        kfile_close_file(varimaaHandle);
+            HEIGHTMAP = NULL;
+            TILEMAP = NULL;
+
+            kgroundchunks_open(maastoFilename, varimaaFilename, HEIGHTMAP_WIDTH);
+        }
+        else
+        {
+            assert(((HEIGHTMAP_WIDTH == 64) || (HEIGHTMAP_WIDTH == 128)) && "Unsupported heightmap dimensions.");
+
+            kfile_close_file(maastoHandle);
+
+            struct kfile_mapping_s maasto = kfile_map_file(maastoFilename, 0, KFILE_REST_OF_FILE);
+            struct kfile_mapping_s varimaa = kfile_map_file(varimaaFilename, 0, KFILE_REST_OF_FILE);
+
+            assert((sqrt(varimaa.size) == HEIGHTMAP_WIDTH) && "Invalid tilemap dimensions.");
+
+            HEIGHTMAP = malloc(sizeof(*HEIGHTMAP) * HEIGHTMAP_WIDTH * HEIGHTMAP_HEIGHT);
+            TILEMAP = malloc(TILEMAP_WIDTH * TILEMAP_HEIGHT);
+
+            for (unsigned i = 0; i < (HEIGHTMAP_WIDTH * HEIGHTMAP_HEIGHT); i++)
+            {
+                HEIGHTMAP[i] = kgroundchunks_maasto_height(&maasto.data[i * 2]);
+            }
+
+            memcpy(TILEMAP, varimaa.data, (TILEMAP_WIDTH * TILEMAP_HEIGHT));
+
+            kfile_unmap_file(&maasto);
+            kfile_unmap_file(&varimaa);
+        }
+    }
+
+    // Work out the tiles' records. A streamed track's tiles have theirs worked
+    // out as they come into view, since the records would take up memory in
+    // proportion to the track's size.
+    if (!TRACK_IS_STREAMED)
+    {
+        TILE_RECORDS_WIDTH = (TILEMAP_WIDTH + 1);
+        TILE_RECORDS_HEIGHT = (TILEMAP_HEIGHT + 1);
+        TILE_RECORDS = malloc(sizeof(*TILE_RECORDS) * TILE_RECORDS_WIDTH * TILE_RECORDS_HEIGHT);
+
+        if (TILE_RECORDS)
+        {
+            for (int y = 0; y < TILE_RECORDS_HEIGHT; y++)
+            {
+                for (int x = 0; x < TILE_RECORDS_WIDTH; x++)
+                {
+                    make_tile_record(&TILE_RECORDS[x + (y * TILE_RECORDS_WIDTH)], x, y);
+                }
+            }
+        }
+    }
+    else
+    {
+        TILE_RECORDS = NULL;
     }
 
     // Load prop locations.
     {
-        const file_handle_t rallyeHandle = kfile_open_file("RALLYE.EXE", "rb");
         uint32_t propHeaderByteOffset = 0;
 
         switch (groundIdx)
@@ -365,59 +889,212 @@ void kground_initialize_ground(const unsigned groundIdx)
             default: assert(0 && "Invalid track index."); break;
         }
 
-        kfile_seek(propHeaderByteOffset, rallyeHandle);
+        // The header is the number of props, followed by a 12-byte entry for
+        // each prop.
+        {
+            const file_handle_t rallyeHandle = kfile_open_file("RALLYE.EXE", "rb");
+
+            kfile_read_at((uint8_t*)&NUM_PROPS, 2, propHeaderByteOffset, rallyeHandle);
+
+            kfile_close_file(rallyeHandle);
+        }
+
+        struct kfile_mapping_s propEntries = kfile_map_file("RALLYE.EXE", (propHeaderByteOffset + 2), (NUM_PROPS * 12l));
 
-        kfile_read_byte_array((uint8_t*)&NUM_PROPS, 2, rallyeHandle);
+        PROPS = malloc(sizeof(*PROPS) * (NUM_PROPS + 1));
 
-        assert((NUM_PROPS <= MAX_NUM_PROPS) && "The number of track props would overflow.");
+        assert(PROPS && "Failed to allocate memory for the track's props.");
 
         for (unsigned i = 0; i < NUM_PROPS; i++)
         {
+            const uint8_t *const entry = &propEntries.data[i * 12l];
             uint16_t coordinateByteOffset = 0;
             uint16_t indexByteOffset = 0;
             uint16_t posX = 0, posY = 0, posZ = 0;
 
-            PROPS[i] = malloc(sizeof(struct track_prop_s));
-   
-            kfile_read_byte_array((uint8_t*)&coordinateByteOffset, 2, rallyeHandle);
-            kfile_read_byte_array((uint8_t*)&indexByteOffset, 2, rallyeHandle);
+            memcpy(&coordinateByteOffset, &entry[0], 2);
+            memcpy(&indexByteOffset, &entry[2], 2);
 
-            kfile_jump(2, rallyeHandle);
+            // Bytes 4 and 5 are skipped.
 
-            kfile_read_byte_array((uint8_t*)&posX, 2, rallyeHandle);
-            kfile_read_byte_array((uint8_t*)&posZ, 2, rallyeHandle);
-            kfile_read_byte_array((uint8_t*)&posY, 2, rallyeHandle);
+            memcpy(&posX, &entry[6], 2);
+            memcpy(&posZ, &entry[8], 2);
+            memcpy(&posY, &entry[10], 2);
 
-            PROPS[i]->position.x = posX;
-            PROPS[i]->position.y = ((posY == 0xffff)? 0 : (255 - (posY + (SURFACE_MESH_TILE_WIDTH * 2))));
-            PROPS[i]->position.z = -posZ;
+            PROPS[i].position.x = posX;
+            PROPS[i].position.y = ((posY == 0xffff)? 0 : (255 - (posY + (SURFACE_MESH_TILE_WIDTH * 2))));
+            PROPS[i].position.z = -posZ;
+
+            // Props without a height of their own stand on the ground.
+            if (!PROPS[i].position.y)
+            {
+                PROPS[i].position.y = HEIGHT_AT(((int)PROPS[i].position.x / SURFACE_MESH_TILE_WIDTH), (-(int)PROPS[i].position.z / SURFACE_MESH_TILE_HEIGHT));
+            }
 
             // Determine the prop's type from the byte offsets to its 3d model data.
-            if      (coordinateByteOffset == 0xd02c && indexByteOffset == 0xd088) PROPS[i]->type = PROP_TYPE_TREE;
-            else if (coordinateByteOffset == 0x47e2 && indexByteOffset == 0x4c98) PROPS[i]->type = PROP_TYPE_WIRE_FENCE;
-            else if (coordinateByteOffset == 0x47e2 && indexByteOffset == 0x4d98) PROPS[i]->type = PROP_TYPE_HORSE_FENCE;
-            else if (coordinateByteOffset == 0x4766 && indexByteOffset == 0x4c20) PROPS[i]->type = PROP_TYPE_TRAFFIC_SIGN_80;
-            else if (coordinateByteOffset == 0x4766 && indexByteOffset == 0x4c5c) PROPS[i]->type = PROP_TYPE_TRAFFIC_SIGN_EXCLAMATION;
-            else if (coordinateByteOffset == 0x4aba && indexByteOffset == 0x4aec) PROPS[i]->type = PROP_TYPE_STONE_POST;
-            else if (coordinateByteOffset == 0x4932 && indexByteOffset == 0x49e4) PROPS[i]->type = PROP_TYPE_LARGE_ROCK;
-            else if (coordinateByteOffset == 0x498e && indexByteOffset == 0x49e4) PROPS[i]->type = PROP_TYPE_SMALL_ROCK;
-            else if (coordinateByteOffset == 0x4466 && indexByteOffset == 0x4560) PROPS[i]->type = PROP_TYPE_LARGE_BILLBOARD;
-            else if (coordinateByteOffset == 0x44e6 && indexByteOffset == 0x4660) PROPS[i]->type = PROP_TYPE_SMALL_BILLBOARD;
-            else if (coordinateByteOffset == 0x48ee && indexByteOffset == 0x4b7c) PROPS[i]->type = PROP_TYPE_BUILDING;
-            else if (coordinateByteOffset == 0x4324 && indexByteOffset == 0x434a) PROPS[i]->type = PROP_TYPE_UTIL_POLE_1;
-            else if (coordinateByteOffset == 0x4324 && indexByteOffset == 0x439c) PROPS[i]->type = PROP_TYPE_UTIL_POLE_2;
-            else if (coordinateByteOffset == 0x5488 && indexByteOffset == 0x5502) PROPS[i]->type = PROP_TYPE_STARTING_LINE;
-            else if (coordinateByteOffset == 0x50d2 && indexByteOffset == 0x51c4) PROPS[i]->type = PROP_TYPE_STONE_STARTING_LINE;
-            else if (coordinateByteOffset == 0x4ff2 && indexByteOffset == 0x51e0) PROPS[i]->type = PROP_TYPE_STONE_ARCH;
+            if      (coordinateByteOffset == 0xd02c && indexByteOffset == 0xd088) PROPS[i].type = PROP_TYPE_TREE;
+            else if (coordinateByteOffset == 0x47e2 && indexByteOffset == 0x4c98) PROPS[i].type = PROP_TYPE_WIRE_FENCE;
+            else if (coordinateByteOffset == 0x47e2 && indexByteOffset == 0x4d98) PROPS[i].type = PROP_TYPE_HORSE_FENCE;
+            else if (coordinateByteOffset == 0x4766 && indexByteOffset == 0x4c20) PROPS[i].type = PROP_TYPE_TRAFFIC_SIGN_80;
+            else if (coordinateByteOffset == 0x4766 && indexByteOffset == 0x4c5c) PROPS[i].type = PROP_TYPE_TRAFFIC_SIGN_EXCLAMATION;
+            else if (coordinateByteOffset == 0x4aba && indexByteOffset == 0x4aec) PROPS[i].type = PROP_TYPE_STONE_POST;
+            else if (coordinateByteOffset == 0x4932 && indexByteOffset == 0x49e4) PROPS[i].type = PROP_TYPE_LARGE_ROCK;
+            else if (coordinateByteOffset == 0x498e && indexByteOffset == 0x49e4) PROPS[i].type = PROP_TYPE_SMALL_ROCK;
+            else if (coordinateByteOffset == 0x4466 && indexByteOffset == 0x4560) PROPS[i].type = PROP_TYPE_LARGE_BILLBOARD;
+            else if (coordinateByteOffset == 0x44e6 && indexByteOffset == 0x4660) PROPS[i].type = PROP_TYPE_SMALL_BILLBOARD;
+            else if (coordinateByteOffset == 0x48ee && indexByteOffset == 0x4b7c) PROPS[i].type = PROP_TYPE_BUILDING;
+            else if (coordinateByteOffset == 0x4324 && indexByteOffset == 0x434a) PROPS[i].type = PROP_TYPE_UTIL_POLE_1;
+            else if (coordinateByteOffset == 0x4324 && indexByteOffset == 0x439c) PROPS[i].type = PROP_TYPE_UTIL_POLE_2;
+            else if (coordinateByteOffset == 0x5488 && indexByteOffset == 0x5502) PROPS[i].type = PROP_TYPE_STARTING_LINE;
+            else if (coordinateByteOffset == 0x50d2 && indexByteOffset == 0x51c4) PROPS[i].type = PROP_TYPE_STONE_STARTING_LINE;
+            else if (coordinateByteOffset == 0x4ff2 && indexByteOffset == 0x51e0) PROPS[i].type = PROP_TYPE_STONE_ARCH;
             else
             {
                 assert(0 && "Invalid prop type.");
             }
         }
 
-        kfile_close_file(rallyeHandle);
+        kfile_unmap_file(&propEntries);
     }
 
+    return;
+}
+
+void kground_bake_cache(const unsigned groundIdx)
+{
+    struct cached_track_s header;
+
+    kground_initialize_ground(groundIdx);
+    kassetcache_begin_section(KASSETCACHE_TRACKS + groundIdx);
+
+    memset(&header, 0, sizeof(header));
+    header.width = HEIGHTMAP_WIDTH;
+    header.numProps = NUM_PROPS;
+    kassetcache_write(&header, sizeof(header));
+
+    if (!TRACK_IS_STREAMED)
+    {
+        header.heightmapOffs = kassetcache_write(HEIGHTMAP, (sizeof(*HEIGHTMAP) * HEIGHTMAP_WIDTH * HEIGHTMAP_HEIGHT));
+        header.tilemapOffs = kassetcache_write(TILEMAP, (TILEMAP_WIDTH * TILEMAP_HEIGHT));
+
+        if (TILE_RECORDS)
+        {
+            header.tileRecordsOffs = kassetcache_write(TILE_RECORDS, (sizeof(*TILE_RECORDS) * TILE_RECORDS_WIDTH * TILE_RECORDS_HEIGHT));
+
+            for (int i = 0; i < (TILE_RECORDS_WIDTH * TILE_RECORDS_HEIGHT); i++)
+            {
+                header.usedTextures[TILE_RECORDS[i].texture] = 1;
+                header.usedTextures[TILE_RECORDS[i].billboardTexture] = 1;
+            }
+        }
+    }
+
+    header.propsOffs = kassetcache_write(PROPS, (sizeof(*PROPS) * NUM_PROPS));
+    kassetcache_overwrite(0, &header, sizeof(header));
+
+    kground_release_ground();
+
+    return;
+}
+
+// Takes the given track's heightmap, tilemap and props from the asset cache.
+// Returns false if the cache doesn't have them.
+static int use_cached_track(const unsigned groundIdx)
+{
+    uint8_t *const section = kassetcache_section((KASSETCACHE_TRACKS + groundIdx), NULL);
+    const struct cached_track_s *const header = (struct cached_track_s*)section;
+
+    if (!section)
+    {
+        TRACK_IS_CACHED = 0;
+        return 0;
+    }
+
+    TRACK_IS_CACHED = 1;
+    HEIGHTMAP_WIDTH = HEIGHTMAP_HEIGHT = header->width;
+    TILEMAP_WIDTH = TILEMAP_HEIGHT = header->width;
+    TRACK_IS_STREAMED = (header->width > GROUND_MAX_WHOLE_TRACK_WIDTH);
+    HEIGHTMAP = NULL;
+    TILEMAP = NULL;
+    TILE_RECORDS = NULL;
+
+    if (TRACK_IS_STREAMED)
+    {
+        char maastoFilename[20];
+        char varimaaFilename[20];
+        sprintf(maastoFilename, "MAASTO.00%c", ('1' + groundIdx));
+        sprintf(varimaaFilename, "VARIMAA.00%c", ('1' + groundIdx));
+
+        kgroundchunks_open(maastoFilename, varimaaFilename, HEIGHTMAP_WIDTH);
+    }
+    else
+    {
+        HEIGHTMAP = (int16_t*)(section + header->heightmapOffs);
+        TILEMAP = (section + header->tilemapOffs);
+
+        if (header->tileRecordsOffs)
+        {
+            TILE_RECORDS_WIDTH = (TILEMAP_WIDTH + 1);
+            TILE_RECORDS_HEIGHT = (TILEMAP_HEIGHT + 1);
+            TILE_RECORDS = (struct tile_record_s*)(section + header->tileRecordsOffs);
+
+            for (unsigned i = 0; i < 256; i++)
+            {
+                if (header->usedTextures[i])
+                {
+                    PALA_TEXTURES[i] = ktexture_pala_texture(i);
+                }
+            }
+        }
+    }
+
+    NUM_PROPS = header->numProps;
+    PROPS = (struct track_prop_s*)(section + header->propsOffs);
+
+    return 1;
+}
+
+void kground_initialize_ground(const unsigned groundIdx)
+{
+    assert((groundIdx <= 8) && "Ground index out of bounds.");
+
+    // Pre-allocate memory for the surface tiles of both views. Since each
+    // surface tile (a quad polygon) can optionally have a billboard tile (e.g.
+    // a spectator), the surface mesh may have up to twice as many polygons as
+    // there are tiles in the ground view.
+    for (unsigned v = 0; v < 2; v++)
+    {
+        struct ground_view_s *const view = &GROUND_VIEWS[v];
+        const unsigned numTiles = (GROUND_VIEW_WIDTH * GROUND_VIEW_HEIGHT);
+
+        view->meshes = kelpo_generic_stack__create(16, sizeof(struct mesh_s));
+        view->tileRing = malloc(sizeof(*view->tileRing) * numTiles);
+        view->surfacePolys = malloc(sizeof(*view->surfacePolys) * 2 * numTiles);
+
+        assert((view->tileRing && view->surfacePolys) && "Failed to allocate memory for the ground view.");
+
+        for (unsigned i = 0; i < numTiles; i++)
+        {
+            view->tileRing[i].ground = kpolygon_create_polygon(4);
+            view->tileRing[i].billboard = kpolygon_create_polygon(4);
+            view->tileRing[i].ground.color = view->tileRing[i].billboard.color = 0;
+            view->tileRing[i].ground.visible = view->tileRing[i].billboard.visible = 1;
+            view->tileRing[i].hasBillboard = 0;
+        }
+
+        view->tileRingIsValid = 0;
+        view->numSurfacePolys = 0;
+    }
+
+    CURRENT_GROUND_VIEW = 0;
+
+    if (!use_cached_track(groundIdx))
+    {
+        load_track(groundIdx);
+    }
+
+    build_prop_buckets();
+
     kground_update_ground_mesh(3, 22);
 
     return;
@@ -425,15 +1102,43 @@ void kground_initialize_ground(const unsigned groundIdx)
 
 void kground_release_ground(void)
 {
-    free(HEIGHTMAP);
-    free(TILEMAP);
-    free(SURFACE_MESH_POLY_CACHE);
-    kelpo_generic_stack__free(GROUND_VIEW_MESHES);
+    #if GROUND_BUILDER_THREAD
+        stop_ground_builder();
+    #endif
 
-    for (unsigned i = 0; i < NUM_PROPS; i++)
+    GROUND_VIEW_IS_REQUESTED = 0;
+
+    if (TRACK_IS_STREAMED)
+    {
+        kgroundchunks_close();
+    }
+
+    if (!TRACK_IS_CACHED)
     {
-        free(PROPS[i]);
+        free(HEIGHTMAP);
+        free(TILEMAP);
+        free(TILE_RECORDS);
+        free(PROPS);
     }
 
+    for (unsigned v = 0; v < 2; v++)
+    {
+        struct ground_view_s *const view = &GROUND_VIEWS[v];
+
+        for (unsigned i = 0; i < (GROUND_VIEW_WIDTH * GROUND_VIEW_HEIGHT); i++)
+        {
+            kpolygon_release_polygon(&view->tileRing[i].ground);
+            kpolygon_release_polygon(&view->tileRing[i].billboard);
+        }
+
+        free(view->tileRing);
+        free(view->surfacePolys);
+        kelpo_generic_stack__free(view->meshes);
+    }
+
+    free(PROP_BUCKET_STARTS);
+    free(PROP_BUCKET_PROPS);
+    free(VISIBLE_PROPS);
+
     return;
 }
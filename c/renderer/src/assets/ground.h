@@ -12,12 +12,36 @@ int kground_width(void);
 
 int kground_height(void);
 
+// Returns the current ground view's meshes. They stay valid until the next
+// view replaces them.
 const struct kelpo_generic_stack_s* kground_ground_meshes(void);
 
-void kground_update_ground_mesh(const int viewOffsX, const int viewOffsZ);
+// Updates the ground view's meshes to show the track from the given offset, in
+// tiles. The offset may be fractional, in which case the ground is scrolled by
+// the fraction of a tile. Only the tiles that scroll into view are rebuilt.
+void kground_update_ground_mesh(const float viewOffsX, const float viewOffsZ);
+
+// Starts building the next ground view, as kground_update_ground_mesh() would,
+// on a worker thread where threads are available; otherwise builds it before
+// returning. The current view's meshes are left as they are, so they can be
+// drawn in the meantime, and are replaced by the new view's once it's handed
+// over with kground_swap_ground_mesh(). That must be done before the ground
+// view is next requested or updated. Building a view doesn't touch the
+// renderer's state, so the renderer can be used and set up freely meanwhile.
+// A view may still be being built when the program ends, so the ground must be
+// released (which waits for the build) before the meshes and textures are.
+void kground_request_ground_mesh(const float viewOffsX, const float viewOffsZ);
+
+// Waits for the view requested with kground_request_ground_mesh() to have been
+// built, then makes it the current view.
+void kground_swap_ground_mesh(void);
 
 void kground_initialize_ground(const unsigned groundIdx);
 
 void kground_release_ground(void);
 
+// Loads the given track from the game's files and writes it into the asset
+// cache being baked. The textures and prop meshes must have been initialized.
+void kground_bake_cache(const unsigned groundIdx);
+
 #endif
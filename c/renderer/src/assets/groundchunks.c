@@ -0,0 +1,288 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ * Streams a track's heightmap and tilemap from disk in square chunks, for
+ * tracks too large to be held in memory whole. A fixed pool of chunks is kept
+ * in memory; when a chunk not in the pool is needed, it's read from the files
+ * into the slot of the least recently used chunk. Memory use is thus bounded
+ * by the pool's size, regardless of the track's.
+ * 
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include "common/file.h"
+#include "assets/groundchunks.h"
+
+// The width and height, in tiles, of a chunk. Must be a power of two.
+#define CHUNK_SIZE_SHIFT 5
+#define CHUNK_SIZE (1 << CHUNK_SIZE_SHIFT)
+
+// How many chunks to keep in memory at most. Must be enough to cover the
+// ground view along with the margin around it that gets prefetched.
+#define MAX_RESIDENT_CHUNKS 36
+
+// How many chunks kgroundchunks_prefetch() may load per call.
+#define MAX_PREFETCH_LOADS 2
+
+struct ground_chunk_s
+{
+    // The chunk's position, in chunks, or -1 if the slot is free.
+    int chunkX, chunkY;
+
+    // The value of USE_CLOCK when the chunk was last accessed.
+    uint32_t lastUsed;
+
+    int16_t heights[CHUNK_SIZE * CHUNK_SIZE];
+    uint8_t tiles[CHUNK_SIZE * CHUNK_SIZE];
+};
+
+static file_handle_t MAASTO_HANDLE;
+static file_handle_t VARIMAA_HANDLE;
+
+// The track's width and height, in tiles and in chunks.
+static unsigned TRACK_WIDTH;
+static unsigned CHUNKS_WIDE;
+
+// Allocated chunk by chunk, to stay within DOS's 64 KB allocation limit.
+static struct ground_chunk_s *CHUNK_POOL[MAX_RESIDENT_CHUNKS];
+
+// For each of the track's chunks, the index of its slot in CHUNK_POOL, or -1
+// if it isn't in memory.
+static int16_t *CHUNK_SLOTS;
+
+// Advanced once per prefetch, i.e. about once per frame, so that the chunks
+// used in the current frame are never the least recently used.
+static uint32_t USE_CLOCK;
+
+// The most recently accessed chunk; consecutive accesses tend to hit the same
+// one.
+static struct ground_chunk_s *LAST_CHUNK;
+
+int16_t kgroundchunks_maasto_height(const uint8_t *const word)
+{
+    // More than -255 below ground level.
+    if (word[1] == 1)
+    {
+        return (-256 - word[0]);
+    }
+    // Above ground when word[1] == 255, otherwise below ground level.
+    else
+    {
+        return (word[1] - word[0]);
+    }
+}
+
+// Reads the given chunk from the files into the given pool slot.
+static void load_chunk(const unsigned slotIdx, const int chunkX, const int chunkY)
+{
+    struct ground_chunk_s *const chunk = CHUNK_POOL[slotIdx];
+    const unsigned x0 = (chunkX * CHUNK_SIZE);
+    const unsigned y0 = (chunkY * CHUNK_SIZE);
+    const unsigned numCols = (((TRACK_WIDTH - x0) < CHUNK_SIZE)? (TRACK_WIDTH - x0) : CHUNK_SIZE);
+    uint8_t words[CHUNK_SIZE * 2];
+
+    // Evict the slot's previous chunk.
+    if (chunk->chunkX >= 0)
+    {
+        CHUNK_SLOTS[chunk->chunkX + (chunk->chunkY * CHUNKS_WIDE)] = -1;
+    }
+
+    // Tiles past the track's edge are left at 0.
+    for (unsigned i = 0; i < (CHUNK_SIZE * CHUNK_SIZE); i++)
+    {
+        chunk->heights[i] = 0;
+        chunk->tiles[i] = 0;
+    }
+
+    for (unsigned row = 0; (row < CHUNK_SIZE) && ((y0 + row) < TRACK_WIDTH); row++)
+    {
+        const uint32_t cellIdx = (x0 + ((y0 + row) * TRACK_WIDTH));
+
+        kfile_read_at(words, (numCols * 2), (cellIdx * 2), MAASTO_HANDLE);
+
+        for (unsigned col = 0; col < numCols; col++)
+        {
+            chunk->heights[col + (row * CHUNK_SIZE)] = kgroundchunks_maasto_height(&words[col * 2]);
+        }
+
+        kfile_read_at(&chunk->tiles[row * CHUNK_SIZE], numCols, cellIdx, VARIMAA_HANDLE);
+    }
+
+    chunk->chunkX = chunkX;
+    chunk->chunkY = chunkY;
+    chunk->lastUsed = USE_CLOCK;
+    CHUNK_SLOTS[chunkX + (chunkY * CHUNKS_WIDE)] = slotIdx;
+
+    return;
+}
+
+// Returns the slot of the least recently used chunk in the pool, preferring
+// free slots.
+static unsigned least_recently_used_slot(void)
+{
+    unsigned lruIdx = 0;
+
+    for (unsigned i = 0; i < MAX_RESIDENT_CHUNKS; i++)
+    {
+        if (CHUNK_POOL[i]->chunkX < 0)
+        {
+            return i;
+        }
+
+        if (CHUNK_POOL[i]->lastUsed < CHUNK_POOL[lruIdx]->lastUsed)
+        {
+            lruIdx = i;
+        }
+    }
+
+    return lruIdx;
+}
+
+// Returns the chunk containing the given track tile coordinates, which must be
+// inside the track, loading the chunk if need be.
+static struct ground_chunk_s* chunk_at(const unsigned x, const unsigned y)
+{
+    const int chunkX = (x >> CHUNK_SIZE_SHIFT);
+    const int chunkY = (y >> CHUNK_SIZE_SHIFT);
+
+    if ((LAST_CHUNK->chunkX != chunkX) ||
+        (LAST_CHUNK->chunkY != chunkY))
+    {
+        int slotIdx = CHUNK_SLOTS[chunkX + (chunkY * CHUNKS_WIDE)];
+
+        if (slotIdx < 0)
+        {
+            slotIdx = least_recently_used_slot();
+            load_chunk(slotIdx, chunkX, chunkY);
+        }
+
+        LAST_CHUNK = CHUNK_POOL[slotIdx];
+    }
+
+    LAST_CHUNK->lastUsed = USE_CLOCK;
+
+    return LAST_CHUNK;
+}
+
+int16_t kgroundchunks_height_at(const int x, const int y)
+{
+    if ((x < 0) || (x >= (int)TRACK_WIDTH) ||
+        (y < 0) || (y >= (int)TRACK_WIDTH))
+    {
+        return 0;
+    }
+
+    return chunk_at(x, y)->heights[(x & (CHUNK_SIZE - 1)) + ((y & (CHUNK_SIZE - 1)) * CHUNK_SIZE)];
+}
+
+uint8_t kgroundchunks_tile_at(const int x, const int y)
+{
+    if ((x < 0) || (x >= (int)TRACK_WIDTH) ||
+        (y < 0) || (y >= (int)TRACK_WIDTH))
+    {
+        return 0;
+    }
+
+    return chunk_at(x, y)->tiles[(x & (CHUNK_SIZE - 1)) + ((y & (CHUNK_SIZE - 1)) * CHUNK_SIZE)];
+}
+
+void kgroundchunks_prefetch(const int x0, const int y0, const int x1, const int y1)
+{
+    const int firstChunkX = ((x0 < 0)? 0 : (x0 >> CHUNK_SIZE_SHIFT));
+    const int firstChunkY = ((y0 < 0)? 0 : (y0 >> CHUNK_SIZE_SHIFT));
+    const int lastChunkX = ((x1 >= (int)TRACK_WIDTH)? (CHUNKS_WIDE - 1) : (x1 >> CHUNK_SIZE_SHIFT));
+    const int lastChunkY = ((y1 >= (int)TRACK_WIDTH)? (CHUNKS_WIDE - 1) : (y1 >> CHUNK_SIZE_SHIFT));
+    unsigned numLoads = 0;
+
+    USE_CLOCK++;
+
+    for (int cy = firstChunkY; cy <= lastChunkY; cy++)
+    {
+        for (int cx = firstChunkX; cx <= lastChunkX; cx++)
+        {
+            const int slotIdx = CHUNK_SLOTS[cx + (cy * CHUNKS_WIDE)];
+
+            if (slotIdx >= 0)
+            {
+                CHUNK_POOL[slotIdx]->lastUsed = USE_CLOCK;
+            }
+            else if (numLoads < MAX_PREFETCH_LOADS)
+            {
+                load_chunk(least_recently_used_slot(), cx, cy);
+                numLoads++;
+            }
+        }
+    }
+
+    return;
+}
+
+unsigned kgroundchunks_num_resident(void)
+{
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < MAX_RESIDENT_CHUNKS; i++)
+    {
+        count += (CHUNK_POOL[i]->chunkX >= 0);
+    }
+
+    return count;
+}
+
+void kgroundchunks_open(const char *const maastoFilename,
+                        const char *const varimaaFilename,
+                        const unsigned width)
+{
+    TRACK_WIDTH = width;
+    CHUNKS_WIDE = ((width + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    USE_CLOCK = 0;
+
+    MAASTO_HANDLE = kfile_open_file(maastoFilename, "rb");
+    VARIMAA_HANDLE = kfile_open_file(varimaaFilename, "rb");
+
+    assert((kfile_file_size(MAASTO_HANDLE) == (2 * width * width)) && "Invalid heightmap dimensions.");
+    assert((kfile_file_size(VARIMAA_HANDLE) == (width * width)) && "Invalid tilemap dimensions.");
+
+    CHUNK_SLOTS = malloc(sizeof(*CHUNK_SLOTS) * CHUNKS_WIDE * CHUNKS_WIDE);
+
+    assert(CHUNK_SLOTS && "Failed to allocate memory for the ground chunks.");
+
+    for (unsigned i = 0; i < MAX_RESIDENT_CHUNKS; i++)
+    {
+        CHUNK_POOL[i] = malloc(sizeof(*CHUNK_POOL[i]));
+
+        assert(CHUNK_POOL[i] && "Failed to allocate memory for the ground chunks.");
+
+        CHUNK_POOL[i]->chunkX = CHUNK_POOL[i]->chunkY = -1;
+        CHUNK_POOL[i]->lastUsed = 0;
+    }
+
+    for (unsigned i = 0; i < (CHUNKS_WIDE * CHUNKS_WIDE); i++)
+    {
+        CHUNK_SLOTS[i] = -1;
+    }
+
+    LAST_CHUNK = CHUNK_POOL[0];
+
+    return;
+}
+
+void kgroundchunks_close(void)
+{
+    kfile_close_file(MAASTO_HANDLE);
+    kfile_close_file(VARIMAA_HANDLE);
+
+    for (unsigned i = 0; i < MAX_RESIDENT_CHUNKS; i++)
+    {
+        free(CHUNK_POOL[i]);
+        CHUNK_POOL[i] = NULL;
+    }
+
+    free(CHUNK_SLOTS);
+    CHUNK_SLOTS = NULL;
+
+    return;
+}
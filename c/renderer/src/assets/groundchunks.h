@@ -0,0 +1,42 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ */
+
+#ifndef GROUND_CHUNKS_H
+#define GROUND_CHUNKS_H
+
+#include <stdint.h>
+
+// Opens the given MAASTO (heightmap) and VARIMAA (tilemap) files, of a square
+// track the given number of tiles wide, for streaming. Only the chunks of the
+// track that are in use are kept in memory.
+void kgroundchunks_open(const char *const maastoFilename,
+                        const char *const varimaaFilename,
+                        const unsigned width);
+
+void kgroundchunks_close(void);
+
+// Returns the heightmap value at the given track tile coordinates, or 0 if
+// they're outside the track. The chunk holding the value is loaded if need be.
+int16_t kgroundchunks_height_at(const int x, const int y);
+
+// Returns the tilemap value at the given track tile coordinates, or 0 if
+// they're outside the track. The chunk holding the value is loaded if need be.
+uint8_t kgroundchunks_tile_at(const int x, const int y);
+
+// Loads some of the not-yet-loaded chunks overlapping the given rectangle of
+// track tiles (inclusive), so that they're in memory by the time they're asked
+// for. At most a few chunks are loaded per call, to spread the file access
+// over several calls.
+void kgroundchunks_prefetch(const int x0, const int y0, const int x1, const int y1);
+
+// Returns the number of chunks currently in memory.
+unsigned kgroundchunks_num_resident(void);
+
+// Decodes the given 2-byte MAASTO heightmap entry into a height value.
+int16_t kgroundchunks_maasto_height(const uint8_t *const word);
+
+#endif
@@ -13,15 +13,83 @@
 #include "common/genstack.h"
 #include "common/file.h"
 #include "assets/mesh.h"
+#include "assets/assetcache.h"
 
 static struct mesh_s *PROP_MESHES;
 
-struct mesh_s load_prop_mesh(const int propType)
+// Whether PROP_MESHES are in the asset cache rather than loaded from the game's
+// files.
+static int PROP_MESHES_ARE_CACHED = 0;
+
+// Grows the mesh's bounding box to enclose the given vertex.
+static void enclose_in_mesh_bounds(struct mesh_s *const mesh, const struct vertex_s *const vert)
+{
+    if (!mesh->hasBounds)
+    {
+        mesh->minX = mesh->maxX = vert->x;
+        mesh->minY = mesh->maxY = vert->y;
+        mesh->minZ = mesh->maxZ = vert->z;
+        mesh->hasBounds = 1;
+
+        return;
+    }
+
+    if (vert->x < mesh->minX) mesh->minX = vert->x;
+    if (vert->x > mesh->maxX) mesh->maxX = vert->x;
+    if (vert->y < mesh->minY) mesh->minY = vert->y;
+    if (vert->y > mesh->maxY) mesh->maxY = vert->y;
+    if (vert->z < mesh->minZ) mesh->minZ = vert->z;
+    if (vert->z > mesh->maxZ) mesh->maxZ = vert->z;
+
+    return;
+}
+
+// Sets the mesh's bounding box to enclose its polygons' vertices.
+static void compute_mesh_bounds(struct mesh_s *const mesh)
+{
+    mesh->hasBounds = 0;
+
+    for (unsigned i = 0; i < mesh->numPolys; i++)
+    {
+        for (unsigned v = 0; v < mesh->polys[i].numVerts; v++)
+        {
+            const struct polygon_s *const poly = &mesh->polys[i];
+
+            enclose_in_mesh_bounds(mesh, (poly->vertIndices? &mesh->verts[poly->vertIndices[v]] : &poly->verts[v]));
+        }
+    }
+
+    return;
+}
+
+// The byte offset in RALLYE.EXE of its data segment, and of the earliest prop
+// mesh data in it.
+#define RALLYE_DATA_SEGMENT_OFFS 70560l
+#define PROP_MESH_DATA_OFFS (RALLYE_DATA_SEGMENT_OFFS + 0x4324)
+
+// Returns the 2-byte value at the given byte offset in the mapped prop mesh
+// data.
+static uint16_t mesh_data_word(const struct kfile_mapping_s *const meshData, const uint32_t offs)
+{
+    uint16_t word;
+
+    assert(((offs + 2) <= meshData->size) && "Prop mesh data out of bounds.");
+
+    memcpy(&word, &meshData->data[offs], 2);
+
+    return word;
+}
+
+// Loads the given type of prop mesh from RALLYE.EXE's prop mesh data, which
+// begins at PROP_MESH_DATA_OFFS.
+struct mesh_s load_prop_mesh(const int propType, const struct kfile_mapping_s *const meshData)
 {
     struct mesh_s mesh;
-    const file_handle_t rallyeHandle = kfile_open_file("RALLYE.EXE", "rb");
     struct kelpo_generic_stack_s *polyStack = kelpo_generic_stack__create(0, sizeof(struct polygon_s));
 
+    // As with the polygons below, zero the padding for baking.
+    memset(&mesh, 0, sizeof(mesh));
+
     // Byte offsets in RALLYE.EXE where the corresponding data begins.
     uint32_t vertexCoordsOffs = 0;
     uint32_t vertexIndicesOffs = 0;
@@ -47,82 +115,84 @@ struct mesh_s load_prop_mesh(const int propType)
         default: assert(0 && "Unknown prop type."); break;
     }
 
-    // Append the starting offset of RALLYE.EXE's data segment.
-    vertexCoordsOffs += 70560;
-    vertexIndicesOffs += 70560;
+    // Make the offsets relative to the start of the prop mesh data.
+    vertexCoordsOffs -= (PROP_MESH_DATA_OFFS - RALLYE_DATA_SEGMENT_OFFS);
+    vertexIndicesOffs -= (PROP_MESH_DATA_OFFS - RALLYE_DATA_SEGMENT_OFFS);
 
-    // Load vertex coordinates.
+    // Load vertex coordinates. The mesh's polygons will share these, referring
+    // to them by index.
     struct vertex_s *vertexCoords = NULL;
+    uint16_t numCoords = 0;
     {
-        kfile_seek(vertexCoordsOffs, rallyeHandle);
+        numCoords = mesh_data_word(meshData, vertexCoordsOffs);
 
-        uint16_t numCoords = 0;    
-        kfile_read_byte_array((uint8_t*)&numCoords, sizeof(numCoords), rallyeHandle);
-        vertexCoords = malloc(sizeof(*vertexCoords) * numCoords);
+        // Zeroed, as the vertices' colors and padding aren't otherwise set and
+        // are baked into the asset cache along with the coordinates.
+        vertexCoords = calloc(numCoords, sizeof(*vertexCoords));
 
         for (int i = 0; i < numCoords; i++)
         {
-            int16_t coords[3];
-            kfile_read_byte_array((uint8_t*)coords, (sizeof(*coords) * 3), rallyeHandle);
-            
-            vertexCoords[i].x = coords[0];
-            vertexCoords[i].y = coords[1];
-            vertexCoords[i].z = coords[2];
+            const uint32_t coordsOffs = (vertexCoordsOffs + 2 + (i * 6));
+
+            vertexCoords[i].x = (int16_t)mesh_data_word(meshData, coordsOffs);
+            vertexCoords[i].y = (int16_t)mesh_data_word(meshData, (coordsOffs + 2));
+            vertexCoords[i].z = (int16_t)mesh_data_word(meshData, (coordsOffs + 4));
         }
     }
 
     assert(vertexCoords && "Failed to properly load prop mesh vertex coordinates.");
 
     // Load polygons.
-    kfile_seek(vertexIndicesOffs, rallyeHandle);
-    for (;;)
+    for (uint32_t offs = vertexIndicesOffs;;)
     {
         // The first 2 bytes of the one-after-last polygon entry are 0xFFFF.
+        if (mesh_data_word(meshData, offs) == 0xffff)
         {
-            uint16_t word;
-            kfile_read_byte_array((uint8_t*)&word, 2, rallyeHandle);
-
-            if (word == 0xffff)
-            {
-                break;
-            }
-
-            kfile_jump(-2, rallyeHandle);
+            break;
         }
 
-        uint16_t fillStyle = 0;
-        kfile_read_byte_array((uint8_t*)&fillStyle, 2, rallyeHandle);
+        const uint16_t fillStyle = mesh_data_word(meshData, offs);
+        offs += 2;
 
         // Skip some bytes whose purpose we don't know.
-        kfile_jump(8, rallyeHandle);
+        offs += 8;
 
         // Get the polygon's vertices.
         uint16_t numVerts = 0;
         uint16_t *vertexIndices = NULL;
         {
-            kfile_read_byte_array((uint8_t*)&numVerts, 2, rallyeHandle);
+            numVerts = mesh_data_word(meshData, offs);
+            offs += 2;
 
             // Read in the vertex indices.
             vertexIndices = malloc(sizeof(*vertexIndices) * numVerts);
             {
                 // First index.
-                kfile_read_byte_array((uint8_t*)&vertexIndices[0], sizeof(*vertexIndices), rallyeHandle);
+                vertexIndices[0] = mesh_data_word(meshData, offs);
+                offs += 2;
 
                 // Rest of the indices.
                 for (int i = 0; i < (numVerts - 1); i++)
                 {
-                    kfile_read_byte_array((uint8_t*)&vertexIndices[i+1], sizeof(*vertexIndices), rallyeHandle);
-                    kfile_jump(2, rallyeHandle);
+                    vertexIndices[i+1] = mesh_data_word(meshData, offs);
+                    offs += 4;
                 }
 
                 // Skip the last index, which just connects to the first index.
-                kfile_jump(2, rallyeHandle);
+                offs += 2;
             }
         }
 
         // Construct the polygon.
-        struct polygon_s poly = kpolygon_create_polygon(numVerts);
+        struct polygon_s poly;
         {
+            // Zero the padding too, since the polygon may be baked into the
+            // asset cache as it is in memory.
+            memset(&poly, 0, sizeof(poly));
+
+            poly.numVerts = numVerts;
+            poly.verts = NULL;
+            poly.vertIndices = vertexIndices;
             poly.visible = 1;
             
             // Solid color without a texture.
@@ -140,23 +210,22 @@ struct mesh_s load_prop_mesh(const int propType)
 
             for (int i = 0; i < numVerts; i++)
             {
-                poly.verts[i] = vertexCoords[vertexIndices[i]];
+                assert((vertexIndices[i] < numCoords) && "Prop mesh vertex index out of bounds.");
             }
         }
 
         kelpo_generic_stack__push_copy(polyStack, &poly);
-
-        free(vertexIndices);
     }
 
     // Copy into the mesh the polygons we've constructed.
     mesh.numPolys = polyStack->count;
     mesh.polys = malloc(sizeof(struct polygon_s) * polyStack->count);
     memcpy(mesh.polys, polyStack->data, sizeof(struct polygon_s) * polyStack->count);
+    mesh.numVerts = numCoords;
+    mesh.verts = vertexCoords;
+    compute_mesh_bounds(&mesh);
 
-    free(vertexCoords);
     kelpo_generic_stack__free(polyStack);
-    kfile_close_file(rallyeHandle);
 
     return mesh;
 }
@@ -173,20 +242,125 @@ struct mesh_s kmesh_prop_mesh(const int propType, const float x, const float y,
     return mesh;
 }
 
+void kmesh_bake_cache(void)
+{
+    const struct texture_s *const firstTexture = ktexture_prop_texture(0);
+
+    kassetcache_begin_section(KASSETCACHE_PROP_MESHES);
+
+    const uint32_t meshesOffs = kassetcache_write(PROP_MESHES, (sizeof(*PROP_MESHES) * PROP_TYPE_COUNT));
+
+    for (unsigned i = 0; i < PROP_TYPE_COUNT; i++)
+    {
+        // Copied bytewise, so that the padding zeroed when the mesh was loaded
+        // is baked rather than whatever a struct assignment leaves there.
+        struct mesh_s mesh;
+        memcpy(&mesh, &PROP_MESHES[i], sizeof(mesh));
+
+        const uint32_t polysOffs = kassetcache_write(mesh.polys, (sizeof(*mesh.polys) * mesh.numPolys));
+
+        for (unsigned p = 0; p < mesh.numPolys; p++)
+        {
+            struct polygon_s poly;
+            memcpy(&poly, &mesh.polys[p], sizeof(poly));
+
+            poly.vertIndices = KASSETCACHE_OFFSET_AS_POINTER(kassetcache_write(poly.vertIndices, (sizeof(*poly.vertIndices) * poly.numVerts)));
+
+            // Textures are stored by their prop texture index, plus 1 so that
+            // 0 means no texture.
+            poly.texture = KASSETCACHE_OFFSET_AS_POINTER(poly.texture? ((poly.texture - firstTexture) + 1) : 0);
+
+            kassetcache_overwrite((polysOffs + (p * sizeof(poly))), &poly, sizeof(poly));
+        }
+
+        mesh.polys = KASSETCACHE_OFFSET_AS_POINTER(polysOffs);
+        mesh.verts = KASSETCACHE_OFFSET_AS_POINTER(kassetcache_write(mesh.verts, (sizeof(*mesh.verts) * mesh.numVerts)));
+
+        kassetcache_overwrite((meshesOffs + (i * sizeof(mesh))), &mesh, sizeof(mesh));
+    }
+
+    return;
+}
+
+// Points PROP_MESHES at the meshes in the asset cache. Returns false if the
+// cache doesn't have them.
+static int use_cached_meshes(void)
+{
+    uint8_t *const section = kassetcache_section(KASSETCACHE_PROP_MESHES, NULL);
+
+    if (!section)
+    {
+        return 0;
+    }
+
+    PROP_MESHES = (struct mesh_s*)section;
+    PROP_MESHES_ARE_CACHED = 1;
+
+    if (!kassetcache_mark_relocated(KASSETCACHE_PROP_MESHES))
+    {
+        for (unsigned i = 0; i < PROP_TYPE_COUNT; i++)
+        {
+            struct mesh_s *const mesh = &PROP_MESHES[i];
+
+            mesh->polys = KASSETCACHE_RELOCATE(mesh->polys, section);
+            mesh->verts = KASSETCACHE_RELOCATE(mesh->verts, section);
+
+            for (unsigned p = 0; p < mesh->numPolys; p++)
+            {
+                struct polygon_s *const poly = &mesh->polys[p];
+                const uintptr_t textureIdx = (uintptr_t)poly->texture;
+
+                poly->vertIndices = KASSETCACHE_RELOCATE(poly->vertIndices, section);
+                poly->texture = (textureIdx? ktexture_prop_texture(textureIdx - 1) : NULL);
+            }
+        }
+    }
+
+    return 1;
+}
+
 void kmesh_initialize_meshes(void)
 {
+    if (use_cached_meshes())
+    {
+        return;
+    }
+
+    struct kfile_mapping_s meshData = kfile_map_file("RALLYE.EXE", PROP_MESH_DATA_OFFS, KFILE_REST_OF_FILE);
+
     PROP_MESHES = malloc(sizeof(*PROP_MESHES) * PROP_TYPE_COUNT);
 
     for (unsigned i = 0; i < PROP_TYPE_COUNT; i++)
     {
-        PROP_MESHES[i] = load_prop_mesh(i);
+        PROP_MESHES[i] = load_prop_mesh(i, &meshData);
     }
+
+    kfile_unmap_file(&meshData);
     
     return;
 }
 
 void kmesh_release_meshes(void)
 {
+    if (PROP_MESHES_ARE_CACHED)
+    {
+        PROP_MESHES = NULL;
+        PROP_MESHES_ARE_CACHED = 0;
+
+        return;
+    }
+
+    for (unsigned i = 0; i < PROP_TYPE_COUNT; i++)
+    {
+        for (unsigned p = 0; p < PROP_MESHES[i].numPolys; p++)
+        {
+            free(PROP_MESHES[i].polys[p].vertIndices);
+        }
+
+        free(PROP_MESHES[i].polys);
+        free(PROP_MESHES[i].verts);
+    }
+
     free(PROP_MESHES);
     
     return;
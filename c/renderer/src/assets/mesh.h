@@ -15,9 +15,23 @@ struct mesh_s
     unsigned numPolys;
     struct polygon_s *polys;
 
+    // If not NULL, the vertices shared by the mesh's polygons, which refer to
+    // them by index. The renderer then transforms each vertex only once per
+    // mesh, however many polygons share it. If NULL, each polygon has its own
+    // vertices.
+    unsigned numVerts;
+    struct vertex_s *verts;
+
     // The mesh's world position. These values will be added to copies of the
     // mesh's polygon vertex values at render-time.
     float x, y, z;
+
+    // The bounding box of the mesh's vertices, relative to the mesh's position.
+    // The renderer uses it to skip meshes that are entirely off-screen. Valid
+    // only if hasBounds is true.
+    int hasBounds;
+    float minX, minY, minZ;
+    float maxX, maxY, maxZ;
 };
 
 enum
@@ -51,4 +65,8 @@ void kmesh_initialize_meshes(void);
 
 void kmesh_release_meshes(void);
 
+// Writes the prop meshes, which must have been loaded from the game's files,
+// into the asset cache being baked.
+void kmesh_bake_cache(void);
+
 #endif
@@ -11,6 +11,7 @@
 #include "common/genstack.h"
 #include "common/file.h"
 #include "assets/texture.h"
+#include "assets/assetcache.h"
 
 #if __DMC__
     #define snprintf _snprintf
@@ -19,16 +20,61 @@
 // The maximum number of PALA textures we'll load from any given PALAT file.
 #define MAX_NUM_PALA_TEXTURES 253
 
+// The textures as loaded from the game's files. NULL if the textures were
+// taken from the asset cache.
 static struct kelpo_generic_stack_s *PALA_TEXTURES;
 static struct kelpo_generic_stack_s *PROP_TEXTURES;
 
-// Loads and returns the texture at the given index in Rally-Sport's PALA.00x
-// file. In case of an error, the pixel data pointer of the retuned texture
-// will be set to NULL.
-static struct texture_s load_from_pala(const unsigned textureIdx, const unsigned palaIdx)
+// The textures in use, either the stacks' data or the asset cache's.
+static struct texture_s *PALA_TEXTURE_TABLE;
+static struct texture_s *PROP_TEXTURE_TABLE;
+static uint32_t NUM_PALA_TEXTURES;
+static uint32_t NUM_PROP_TEXTURES;
+
+// The pixels of all PALA textures, and separately of all prop textures, are
+// packed one texture after another into an atlas, so that the texels of
+// textures drawn near each other on screen are near each other in memory. The
+// PALA textures, all 16 x 16, are at 256 * their index. The atlases begin on a
+// cache line. Their allocations are NULL if the atlases are in the asset cache.
+#define ATLAS_ALIGNMENT 64
+static uint8_t *PALA_ATLAS;
+static uint8_t *PROP_ATLAS;
+static uint32_t PALA_ATLAS_SIZE;
+static uint32_t PROP_ATLAS_SIZE;
+static void *PALA_ATLAS_ALLOCATION;
+static void *PROP_ATLAS_ALLOCATION;
+
+// The layout of a texture section in the asset cache. The section holds the
+// textures' table, in which the pixel pointers are section offsets, and their
+// atlas.
+struct cached_textures_s
+{
+    uint32_t count;
+    uint32_t tableOffs;
+    uint32_t atlasOffs;
+    uint32_t atlasSize;
+};
+
+// Byte offset in RALLYE.EXE of the table of prop textures in TEXT1.DTA.
+#define PROP_TEXTURE_TABLE_OFFS 123614l
+
+// Allocates an atlas of the given size aligned to ATLAS_ALIGNMENT. The
+// allocation to be freed is returned via the given pointer.
+static uint8_t* allocate_atlas(const uint32_t size, void **const allocation)
 {
-    assert((palaIdx < 2) && "PALA file index out of bounds.");
+    *allocation = malloc(size + ATLAS_ALIGNMENT - 1);
+
+    assert(*allocation && "Failed to allocate memory for a texture atlas.");
+
+    return (uint8_t*)((((uintptr_t)*allocation) + ATLAS_ALIGNMENT - 1) & ~(uintptr_t)(ATLAS_ALIGNMENT - 1));
+}
 
+// Loads and returns the texture at the given index in Rally-Sport's PALA.00x
+// file, whose contents are given, with its pixels in the PALA atlas. In case
+// of an error, the pixel data pointer of the retuned texture will be set to
+// NULL.
+static struct texture_s load_from_pala(const unsigned textureIdx, const struct kfile_mapping_s *const palat)
+{
     struct texture_s tex;
 
     tex.hasAlpha = ((textureIdx < 175)? 0 : 1);
@@ -41,164 +87,289 @@ static struct texture_s load_from_pala(const unsigned textureIdx, const unsigned
 
     tex.width = 16;
     tex.height = 16;
-    tex.pixels = malloc(tex.width * tex.height);
-
-    char filename[20];
-    snprintf(filename, 20, "PALAT.00%c", ('1' + palaIdx));
+    tex.pixels = &PALA_ATLAS[textureIdx * 256l];
 
-    const file_handle_t palaHandle = kfile_open_file(filename, "rb");
-    kfile_seek((textureIdx * 256), palaHandle);
+    assert((((textureIdx + 1) * 256l) <= palat->size) && "PALA texture out of bounds.");
 
     // Copy this texture's data from the PALAT texture atlas. Note that we flip
     // the texture on the vertical axis so that it doesn't render upside down.
     for (unsigned y = 0; y < tex.height; y++)
     {
-        for (unsigned x = 0; x < tex.width; x++)
-        {
-            kfile_read_byte_array(&tex.pixels[x + (tex.height - y - 1) * tex.width], 1, palaHandle);
-        }
+        memcpy(&tex.pixels[(tex.height - y - 1) * tex.width],
+               &palat->data[(textureIdx * 256l) + (y * tex.width)],
+               tex.width);
     }
 
-    kfile_close_file(palaHandle);
-
     return tex;
 }
 
+// Returns the number of pixels in the texture at the given index in
+// Rally-Sport's TEXT1.DTA file, given RALLYE.EXE's table of the textures; or 0
+// if the index is past the last texture.
+static uint32_t text_texture_size(const unsigned textureIdx, const struct kfile_mapping_s *const textureTable)
+{
+    const uint8_t *const entry = &textureTable->data[textureIdx * 10];
+    uint16_t word;
+
+    assert((((textureIdx + 1) * 10) <= textureTable->size) && "Prop texture table out of bounds.");
+
+    // The first 2 bytes of the one-after-last prop texture entry are 0xFFFF.
+    memcpy(&word, entry, 2);
+
+    return ((word == 0xffff)? 0 : ((entry[0] / 2) * (entry[2] / 2)));
+}
+
 // Loads and returns the texture at the given index in Rally-Sport's TEXT1.DTA
-// file. In case of an error, the pixel data pointer of the retuned texture will
-// be set to NULL.
-static struct texture_s load_from_text(const unsigned textureIdx)
+// file, given the file's contents and RALLYE.EXE's table of the textures, with
+// its pixels at the given position in the prop atlas. In case of an error, the
+// pixel data pointer of the retuned texture will be set to NULL.
+static struct texture_s load_from_text(const unsigned textureIdx,
+                                       const struct kfile_mapping_s *const textureTable,
+                                       const struct kfile_mapping_s *const text,
+                                       uint8_t *const pixels)
 {
     struct texture_s tex;
+    const uint8_t *const entry = &textureTable->data[textureIdx * 10];
 
     tex.hasAlpha = 1;
 
-    const file_handle_t rallyeHandle = kfile_open_file("RALLYE.EXE", "rb");
-    const file_handle_t textHandle = kfile_open_file("TEXT1.DTA", "rb");
-
-    assert((kfile_file_size(textHandle) == 32768) && "Unexpected file size for TEXT1.DTA.");
-
-    kfile_seek((123614 + (textureIdx * 10)), rallyeHandle);
+    assert((((textureIdx + 1) * 10) <= textureTable->size) && "Prop texture table out of bounds.");
 
     // The first 2 bytes of the one-after-last prop texture entry are 0xFFFF.
     {
         uint16_t word;
-        kfile_read_byte_array((uint8_t*)&word, 2, rallyeHandle);
+        memcpy(&word, entry, 2);
 
         if (word == 0xffff)
         {
             tex.pixels = NULL;
             return tex;
         }
-
-        kfile_jump(-2, rallyeHandle);
     }
 
-    kfile_read_byte_array(&tex.width, 1, rallyeHandle);
-    kfile_jump(1, rallyeHandle);
-    kfile_read_byte_array(&tex.height, 1, rallyeHandle);
-    kfile_jump(1, rallyeHandle);
-
-    tex.width /= 2;
-    tex.height /= 2;
-    tex.pixels = malloc(tex.width * tex.height);
+    tex.width = (entry[0] / 2);
+    tex.height = (entry[2] / 2);
+    tex.pixels = pixels;
 
-    kfile_jump(2, rallyeHandle);
+    assert(((pixels + (tex.width * tex.height)) <= (PROP_ATLAS + PROP_ATLAS_SIZE)) && "Prop texture out of the atlas's bounds.");
 
     // Offset of this texture in the texture atlas of TEXT1.DTA.
-    unsigned xOffset = 0;
-    unsigned yOffset = 0;
-    kfile_read_byte_array((uint8_t*)&xOffset, 1, rallyeHandle);
-    kfile_read_byte_array((uint8_t*)&yOffset, 1, rallyeHandle);
-    yOffset *= 2;
+    const unsigned xOffset = entry[6];
+    const unsigned yOffset = (entry[7] * 2);
+
+    assert(((xOffset + tex.width + ((yOffset + tex.height - 1) * 128l)) <= text->size) && "Prop texture out of bounds.");
 
     // Copy this texture's data from the TEXT1.DTA texture atlas. Note that we
     // flip the texture on the vertical axis so that it doesn't render upside
     // down.
     for (unsigned y = 0; y < tex.height; y++)
     {
-        kfile_seek((xOffset + (yOffset + y) * 128), textHandle);
-
-        for (unsigned x = 0; x < tex.width; x++)
-        {
-            kfile_read_byte_array(&tex.pixels[x + (tex.height - y - 1) * tex.width], 1, textHandle);
-        }
+        memcpy(&tex.pixels[(tex.height - y - 1) * tex.width],
+               &text->data[xOffset + ((yOffset + y) * 128l)],
+               tex.width);
     }
 
-    kfile_close_file(rallyeHandle);
-    kfile_close_file(textHandle);
-
     return tex;
 }
 
 struct texture_s* ktexture_prop_texture(unsigned propTextureIdx)
 {
-    if (propTextureIdx > PROP_TEXTURES->count)
+    if (propTextureIdx > NUM_PROP_TEXTURES)
     {
         propTextureIdx = 0;
     }
 
-    return (struct texture_s*)kelpo_generic_stack__at(PROP_TEXTURES, propTextureIdx);
+    assert((propTextureIdx < NUM_PROP_TEXTURES) && "Accessing prop textures out of bounds.");
+
+    return &PROP_TEXTURE_TABLE[propTextureIdx];
 }
 
 struct texture_s* ktexture_pala_texture(unsigned palaTextureIdx)
 {
-    if (palaTextureIdx > PALA_TEXTURES->count)
+    if (palaTextureIdx > NUM_PALA_TEXTURES)
     {
         palaTextureIdx = 0;
     }
 
-    return (struct texture_s*)kelpo_generic_stack__at(PALA_TEXTURES, palaTextureIdx);
+    assert((palaTextureIdx < NUM_PALA_TEXTURES) && "Accessing PALA textures out of bounds.");
+
+    return &PALA_TEXTURE_TABLE[palaTextureIdx];
+}
+
+// Writes the given textures and their atlas into the given section of the
+// asset cache.
+static void bake_textures(const unsigned sectionIdx,
+                          const struct texture_s *const textures,
+                          const uint32_t count,
+                          const uint8_t *const atlas,
+                          const uint32_t atlasSize)
+{
+    struct cached_textures_s header;
+
+    kassetcache_begin_section(sectionIdx);
+
+    header.count = count;
+    header.atlasSize = atlasSize;
+    kassetcache_write(&header, sizeof(header));
+    header.tableOffs = kassetcache_write(textures, (sizeof(*textures) * count));
+    header.atlasOffs = kassetcache_write_aligned(atlas, atlasSize, ATLAS_ALIGNMENT);
+    kassetcache_overwrite(0, &header, sizeof(header));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct texture_s tex = textures[i];
+
+        tex.pixels = KASSETCACHE_OFFSET_AS_POINTER(header.atlasOffs + (tex.pixels - atlas));
+        kassetcache_overwrite((header.tableOffs + (i * sizeof(tex))), &tex, sizeof(tex));
+    }
+
+    return;
+}
+
+void ktexture_bake_cache(void)
+{
+    bake_textures(KASSETCACHE_PROP_TEXTURES, PROP_TEXTURE_TABLE, NUM_PROP_TEXTURES, PROP_ATLAS, PROP_ATLAS_SIZE);
+    bake_textures(KASSETCACHE_PALA_TEXTURES, PALA_TEXTURE_TABLE, NUM_PALA_TEXTURES, PALA_ATLAS, PALA_ATLAS_SIZE);
+
+    return;
+}
+
+// Points the given texture table and atlas at the textures in the given section
+// of the asset cache. Returns false if the cache doesn't have them.
+static int use_cached_textures(const unsigned sectionIdx,
+                               struct texture_s **const table,
+                               uint32_t *const count,
+                               uint8_t **const atlas,
+                               uint32_t *const atlasSize)
+{
+    uint8_t *const section = kassetcache_section(sectionIdx, NULL);
+    const struct cached_textures_s *const header = (struct cached_textures_s*)section;
+
+    if (!section)
+    {
+        return 0;
+    }
+
+    *table = (struct texture_s*)(section + header->tableOffs);
+    *count = header->count;
+    *atlas = (section + header->atlasOffs);
+    *atlasSize = header->atlasSize;
+
+    if (!kassetcache_mark_relocated(sectionIdx))
+    {
+        for (uint32_t i = 0; i < header->count; i++)
+        {
+            (*table)[i].pixels = KASSETCACHE_RELOCATE((*table)[i].pixels, section);
+        }
+    }
+
+    return 1;
 }
 
 void ktexture_release_textures(void)
 {
-    for (unsigned i = 0; i < PROP_TEXTURES->count; i++)
+    if (PROP_TEXTURES)
     {
-        free(((struct texture_s*)kelpo_generic_stack__at(PROP_TEXTURES, i))->pixels);
+        kelpo_generic_stack__free(PROP_TEXTURES);
+        PROP_TEXTURES = NULL;
     }
 
-    for (unsigned i = 0; i < PALA_TEXTURES->count; i++)
+    if (PALA_TEXTURES)
     {
-        free(((struct texture_s*)kelpo_generic_stack__at(PALA_TEXTURES, i))->pixels);
+        kelpo_generic_stack__free(PALA_TEXTURES);
+        PALA_TEXTURES = NULL;
     }
 
-    kelpo_generic_stack__free(PROP_TEXTURES);
-    kelpo_generic_stack__free(PALA_TEXTURES);
+    free(PROP_ATLAS_ALLOCATION);
+    free(PALA_ATLAS_ALLOCATION);
+
+    PROP_ATLAS_ALLOCATION = PALA_ATLAS_ALLOCATION = NULL;
+    PROP_ATLAS = PALA_ATLAS = NULL;
+    PROP_ATLAS_SIZE = PALA_ATLAS_SIZE = 0;
+    PROP_TEXTURE_TABLE = PALA_TEXTURE_TABLE = NULL;
+    NUM_PROP_TEXTURES = NUM_PALA_TEXTURES = 0;
 
     return;
 }
 
 void ktexture_initialize_textures(void)
 {
+    if (use_cached_textures(KASSETCACHE_PROP_TEXTURES, &PROP_TEXTURE_TABLE, &NUM_PROP_TEXTURES, &PROP_ATLAS, &PROP_ATLAS_SIZE) &&
+        use_cached_textures(KASSETCACHE_PALA_TEXTURES, &PALA_TEXTURE_TABLE, &NUM_PALA_TEXTURES, &PALA_ATLAS, &PALA_ATLAS_SIZE))
+    {
+        PROP_TEXTURES = PALA_TEXTURES = NULL;
+
+        return;
+    }
+
     PROP_TEXTURES = kelpo_generic_stack__create(23, sizeof(struct texture_s));
     PALA_TEXTURES = kelpo_generic_stack__create(255, sizeof(struct texture_s));
 
     // Load all prop textures.
-    for (struct texture_s tex;;)
     {
-        if ((tex = load_from_text(PROP_TEXTURES->count)).pixels)
+        struct kfile_mapping_s textureTable = kfile_map_file("RALLYE.EXE", PROP_TEXTURE_TABLE_OFFS, KFILE_REST_OF_FILE);
+        struct kfile_mapping_s text = kfile_map_file("TEXT1.DTA", 0, KFILE_REST_OF_FILE);
+
+        assert((text.size == 32768) && "Unexpected file size for TEXT1.DTA.");
+
+        PROP_ATLAS_SIZE = 0;
+
+        for (unsigned i = 0; text_texture_size(i, &textureTable); i++)
         {
-            kelpo_generic_stack__push_copy(PROP_TEXTURES, &tex);
+            PROP_ATLAS_SIZE += text_texture_size(i, &textureTable);
         }
-        else
+
+        PROP_ATLAS = allocate_atlas(PROP_ATLAS_SIZE, &PROP_ATLAS_ALLOCATION);
+
+        uint8_t *pixels = PROP_ATLAS;
+
+        for (struct texture_s tex;;)
         {
-            break;
+            if ((tex = load_from_text(PROP_TEXTURES->count, &textureTable, &text, pixels)).pixels)
+            {
+                kelpo_generic_stack__push_copy(PROP_TEXTURES, &tex);
+                pixels += (tex.width * tex.height);
+            }
+            else
+            {
+                break;
+            }
         }
+
+        kfile_unmap_file(&textureTable);
+        kfile_unmap_file(&text);
     }
 
     // Load all PALA textures.
-    for (struct texture_s tex;;)
     {
-        if ((tex = load_from_pala(PALA_TEXTURES->count, 0)).pixels)
-        {
-            kelpo_generic_stack__push_copy(PALA_TEXTURES, &tex);
-        }
-        else
+        const unsigned palaIdx = 0;
+        char filename[20];
+        snprintf(filename, 20, "PALAT.00%c", ('1' + palaIdx));
+
+        struct kfile_mapping_s palat = kfile_map_file(filename, 0, ((MAX_NUM_PALA_TEXTURES + 1) * 256l));
+
+        PALA_ATLAS_SIZE = ((MAX_NUM_PALA_TEXTURES + 1) * 256l);
+        PALA_ATLAS = allocate_atlas(PALA_ATLAS_SIZE, &PALA_ATLAS_ALLOCATION);
+
+        for (struct texture_s tex;;)
         {
-            break;
+            if ((tex = load_from_pala(PALA_TEXTURES->count, &palat)).pixels)
+            {
+                kelpo_generic_stack__push_copy(PALA_TEXTURES, &tex);
+            }
+            else
+            {
+                break;
+            }
         }
+
+        kfile_unmap_file(&palat);
     }
 
+    PROP_TEXTURE_TABLE = PROP_TEXTURES->data;
+    PALA_TEXTURE_TABLE = PALA_TEXTURES->data;
+    NUM_PROP_TEXTURES = PROP_TEXTURES->count;
+    NUM_PALA_TEXTURES = PALA_TEXTURES->count;
+
     return;
-}
\ No newline at end of file
+}
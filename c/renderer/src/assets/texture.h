@@ -31,6 +31,10 @@ void ktexture_initialize_textures(void);
 // Frees up any texture memory allocated by ktexture_initialize_textures(), etc.
 void ktexture_release_textures(void);
 
+// Writes the textures, which must have been loaded from the game's files, into
+// the asset cache being baked.
+void ktexture_bake_cache(void);
+
 // Returns the prop texture at the given index.
 struct texture_s* ktexture_prop_texture(unsigned propTextureIdx);
 
@@ -0,0 +1,379 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ * A deterministic frame-timing benchmark. Plays a fixed, scripted camera path
+ * over each of Rally-Sport's tracks, timing every frame with a monotonic clock,
+ * and prints frame time statistics as CSV (the default) or JSON.
+ * 
+ * Usage: bench [--json] [--frames=N] [--no-simd] [--painter] [--threads=N]
+ *              [--clear=full|epoch-depth|epoch] [--projection=divide|float|fixed]
+ *              [--pipelined]
+ * 
+ * With --pipelined, each frame's ground view is built while the previous frame
+ * is rendered (see kground_request_ground_mesh()), and the ground time is that
+ * spent waiting for the view rather than building it.
+ * 
+ * Intended to be built headless (see build_linux_bench_gcc.sh), so that frame
+ * times aren't capped by vsync.
+ * 
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "common/genstack.h"
+#include "common/timer.h"
+#include "assets/mesh.h"
+#include "assets/ground.h"
+#include "assets/assetcache.h"
+#include "assets/texture.h"
+#include "renderer/renderer.h"
+
+#define NUM_TRACKS 8
+
+// Frames rendered before timing begins on each track, to warm up the caches.
+#define NUM_WARMUP_FRAMES 10
+
+// The ground view's size in tiles; the camera path keeps the view inside the
+// track.
+#define VIEW_WIDTH 23
+#define VIEW_HEIGHT 24
+
+struct frame_stats_s
+{
+    unsigned numFrames;
+    uint64_t totalUs;
+    uint64_t groundUs; // Time spent building (or, pipelined, waiting for) the ground view.
+    uint64_t minUs, medianUs, p95Us, p99Us, maxUs;
+
+    // The renderer's own counters over the timed frames.
+    struct krender_stats_s render;
+};
+
+static int compare_u64(const void *a, const void *b)
+{
+    const uint64_t va = *(const uint64_t*)a;
+    const uint64_t vb = *(const uint64_t*)b;
+
+    return ((va < vb)? -1 : (va > vb)? 1 : 0);
+}
+
+// Returns the p'th percentile (0 < p <= 1) of the given sorted values, by the
+// nearest-rank method.
+static uint64_t percentile(const uint64_t *const sorted, const unsigned count, const double p)
+{
+    unsigned rank = (unsigned)ceil(p * count);
+
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+
+    return sorted[rank - 1];
+}
+
+// Sorts the given frame times in place and derives their statistics.
+static void compute_stats(struct frame_stats_s *const stats, uint64_t *const frameUs, const unsigned count)
+{
+    assert(count && "Can't compute statistics for zero frames.");
+
+    qsort(frameUs, count, sizeof(*frameUs), compare_u64);
+
+    stats->numFrames = count;
+    stats->minUs = frameUs[0];
+    stats->medianUs = percentile(frameUs, count, 0.5);
+    stats->p95Us = percentile(frameUs, count, 0.95);
+    stats->p99Us = percentile(frameUs, count, 0.99);
+    stats->maxUs = frameUs[count - 1];
+
+    return;
+}
+
+// Positions the camera for the given frame along the scripted path: a steady
+// forward glide down the track with a slow side-to-side sweep.
+static void scripted_camera(int *const viewX, int *const viewZ,
+                            const unsigned frameIdx, const unsigned numFrames)
+{
+    const int rangeX = (kground_width() - VIEW_WIDTH);
+    const int rangeZ = (kground_height() - VIEW_HEIGHT);
+
+    *viewX = ((rangeX / 2) + (int)floor(sin(frameIdx * 0.05) * (rangeX / 2)));
+    *viewZ = ((frameIdx * rangeZ) / numFrames);
+
+    return;
+}
+
+// Renders a frame of the ground view at the given offset. If pipelined, that
+// view has already been requested, and the view at the given next offset is
+// requested for building while the frame is rendered.
+static void render_frame(const int viewX, const int viewZ,
+                         const int nextViewX, const int nextViewZ,
+                         const int pipelined, uint64_t *const groundUs)
+{
+    krender_clear_surface();
+
+    const uint64_t groundStart = ktimer_now_us();
+    if (pipelined)
+    {
+        kground_swap_ground_mesh();
+        kground_request_ground_mesh(nextViewX, nextViewZ);
+    }
+    else
+    {
+        kground_update_ground_mesh(viewX, viewZ);
+    }
+    *groundUs = (ktimer_now_us() - groundStart);
+
+    const struct kelpo_generic_stack_s *const groundMeshes = kground_ground_meshes();
+
+    for (unsigned i = 0; i < groundMeshes->count; i++)
+    {
+        krender_draw_mesh(kelpo_generic_stack__at(groundMeshes, i), 1);
+    }
+
+    krender_flip_surface();
+
+    return;
+}
+
+static void print_stats(const char *const name, const struct frame_stats_s *const stats,
+                        const int asJson, const int isLast)
+{
+    if (asJson)
+    {
+        printf("    {\"track\": \"%s\", \"frames\": %u, \"total_us\": %llu, \"ground_us\": %llu, "
+               "\"min_us\": %llu, \"median_us\": %llu, \"p95_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu, "
+               "\"flat_polys\": %lu, \"textured_polys\": %lu, \"alpha_textured_polys\": %lu, "
+               "\"culled_polys\": %lu, \"culled_meshes\": %lu, "
+               "\"coarse_rejected_polys\": %lu, \"coarse_rejected_pixels\": %lu}%s\n",
+               name, stats->numFrames,
+               (unsigned long long)stats->totalUs, (unsigned long long)stats->groundUs,
+               (unsigned long long)stats->minUs, (unsigned long long)stats->medianUs,
+               (unsigned long long)stats->p95Us, (unsigned long long)stats->p99Us,
+               (unsigned long long)stats->maxUs,
+               (unsigned long)stats->render.numFlatPolys,
+               (unsigned long)stats->render.numTexturedPolys,
+               (unsigned long)stats->render.numAlphaTexturedPolys,
+               (unsigned long)stats->render.numCulledPolys,
+               (unsigned long)stats->render.numCulledMeshes,
+               (unsigned long)stats->render.numCoarseRejectedPolys,
+               (unsigned long)stats->render.numCoarseRejectedPixels,
+               (isLast? "" : ","));
+    }
+    else
+    {
+        printf("%s,%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+               name, stats->numFrames,
+               (unsigned long long)stats->totalUs, (unsigned long long)stats->groundUs,
+               (unsigned long long)stats->minUs, (unsigned long long)stats->medianUs,
+               (unsigned long long)stats->p95Us, (unsigned long long)stats->p99Us,
+               (unsigned long long)stats->maxUs,
+               (unsigned long)stats->render.numFlatPolys,
+               (unsigned long)stats->render.numTexturedPolys,
+               (unsigned long)stats->render.numAlphaTexturedPolys,
+               (unsigned long)stats->render.numCulledPolys,
+               (unsigned long)stats->render.numCulledMeshes,
+               (unsigned long)stats->render.numCoarseRejectedPolys,
+               (unsigned long)stats->render.numCoarseRejectedPixels);
+    }
+
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    int asJson = 0;
+    int allowSimd = 1;
+    unsigned depthMode = KRENDER_DEPTH_MODE_BUFFER;
+    unsigned clearMode = KRENDER_CLEAR_MODE_FULL;
+    unsigned numFrames = 300;
+    unsigned numThreads = 1;
+    unsigned projection = KRENDER_PROJECTION_DIVIDE;
+    int pipelined = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            asJson = 1;
+        }
+        else if (strcmp(argv[i], "--no-simd") == 0)
+        {
+            allowSimd = 0;
+        }
+        else if (strcmp(argv[i], "--painter") == 0)
+        {
+            depthMode = KRENDER_DEPTH_MODE_PAINTER;
+        }
+        else if (strcmp(argv[i], "--clear=full") == 0)
+        {
+            clearMode = KRENDER_CLEAR_MODE_FULL;
+        }
+        else if (strcmp(argv[i], "--clear=epoch-depth") == 0)
+        {
+            clearMode = KRENDER_CLEAR_MODE_EPOCH_DEPTH;
+        }
+        else if (strcmp(argv[i], "--clear=epoch") == 0)
+        {
+            clearMode = KRENDER_CLEAR_MODE_EPOCH;
+        }
+        else if (strcmp(argv[i], "--projection=divide") == 0)
+        {
+            projection = KRENDER_PROJECTION_DIVIDE;
+        }
+        else if (strcmp(argv[i], "--projection=float") == 0)
+        {
+            projection = KRENDER_PROJECTION_RECIPROCAL_FLOAT;
+        }
+        else if (strcmp(argv[i], "--projection=fixed") == 0)
+        {
+            projection = KRENDER_PROJECTION_RECIPROCAL_FIXED;
+        }
+        else if (strcmp(argv[i], "--pipelined") == 0)
+        {
+            pipelined = 1;
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            numThreads = strtoul((argv[i] + 10), NULL, 10);
+        }
+        else if (strncmp(argv[i], "--frames=", 9) == 0)
+        {
+            numFrames = strtoul((argv[i] + 9), NULL, 10);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--json] [--frames=N] [--no-simd] [--painter] [--threads=N] "
+                            "[--clear=full|epoch-depth|epoch] [--projection=divide|float|fixed] "
+                            "[--pipelined]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!numFrames || !numThreads)
+    {
+        fprintf(stderr, "The number of frames and threads must be positive.\n");
+        return 1;
+    }
+
+    uint64_t *const frameUs = malloc(sizeof(*frameUs) * numFrames);
+    uint64_t *const allFrameUs = malloc(sizeof(*allFrameUs) * numFrames * NUM_TRACKS);
+    struct frame_stats_s trackStats[NUM_TRACKS];
+    struct frame_stats_s allStats;
+
+    assert((frameUs && allFrameUs) && "Failed to allocate memory for frame times.");
+
+    kassetcache_open();
+    ktexture_initialize_textures();
+    kmesh_initialize_meshes();
+    krender_initialize();
+    krender_use_palette(0);
+    krender_use_simd(allowSimd);
+    krender_set_depth_mode(depthMode);
+    krender_set_clear_mode(clearMode);
+    krender_set_thread_count(numThreads);
+    krender_set_projection(projection);
+
+    memset(&allStats, 0, sizeof(allStats));
+
+    for (unsigned t = 0; t < NUM_TRACKS; t++)
+    {
+        struct frame_stats_s *const stats = &trackStats[t];
+        int viewX, viewZ, nextViewX, nextViewZ;
+        uint64_t groundUs;
+
+        memset(stats, 0, sizeof(*stats));
+
+        kground_initialize_ground(t);
+
+        if (pipelined)
+        {
+            scripted_camera(&viewX, &viewZ, 0, numFrames);
+            kground_request_ground_mesh(viewX, viewZ);
+        }
+
+        // The warmup frames go over the start of the path, the last of them
+        // leading back to its first frame for the timed run.
+        for (unsigned f = 0; f < NUM_WARMUP_FRAMES; f++)
+        {
+            scripted_camera(&viewX, &viewZ, f, numFrames);
+            scripted_camera(&nextViewX, &nextViewZ, (((f + 1) < NUM_WARMUP_FRAMES)? (f + 1) : 0), numFrames);
+            render_frame(viewX, viewZ, nextViewX, nextViewZ, pipelined, &groundUs);
+        }
+
+        krender_reset_stats();
+
+        for (unsigned f = 0; f < numFrames; f++)
+        {
+            scripted_camera(&viewX, &viewZ, f, numFrames);
+            scripted_camera(&nextViewX, &nextViewZ, (f + 1), numFrames);
+
+            const uint64_t frameStart = ktimer_now_us();
+            render_frame(viewX, viewZ, nextViewX, nextViewZ, pipelined, &groundUs);
+            frameUs[f] = (ktimer_now_us() - frameStart);
+
+            stats->totalUs += frameUs[f];
+            stats->groundUs += groundUs;
+            allFrameUs[(t * numFrames) + f] = frameUs[f];
+        }
+
+        compute_stats(stats, frameUs, numFrames);
+        stats->render = *krender_stats();
+
+        allStats.totalUs += stats->totalUs;
+        allStats.groundUs += stats->groundUs;
+        allStats.render.numFlatPolys += stats->render.numFlatPolys;
+        allStats.render.numTexturedPolys += stats->render.numTexturedPolys;
+        allStats.render.numAlphaTexturedPolys += stats->render.numAlphaTexturedPolys;
+        allStats.render.numCulledPolys += stats->render.numCulledPolys;
+        allStats.render.numCulledMeshes += stats->render.numCulledMeshes;
+        allStats.render.numCoarseRejectedPolys += stats->render.numCoarseRejectedPolys;
+        allStats.render.numCoarseRejectedPixels += stats->render.numCoarseRejectedPixels;
+
+        kground_release_ground();
+    }
+
+    compute_stats(&allStats, allFrameUs, (numFrames * NUM_TRACKS));
+
+    if (asJson)
+    {
+        printf("{\n  \"tracks\": [\n");
+    }
+    else
+    {
+        printf("track,frames,total_us,ground_us,min_us,median_us,p95_us,p99_us,max_us,"
+               "flat_polys,textured_polys,alpha_textured_polys,culled_polys,culled_meshes,"
+               "coarse_rejected_polys,coarse_rejected_pixels\n");
+    }
+
+    for (unsigned t = 0; t < NUM_TRACKS; t++)
+    {
+        char name[8];
+        sprintf(name, "%u", (t + 1));
+
+        print_stats(name, &trackStats[t], asJson, (t == (NUM_TRACKS - 1)));
+    }
+
+    if (asJson)
+    {
+        printf("  ],\n  \"all\":\n");
+    }
+
+    print_stats("all", &allStats, asJson, 1);
+
+    if (asJson)
+    {
+        printf("}\n");
+    }
+
+    krender_release();
+    ktexture_release_textures();
+    kmesh_release_meshes();
+    kassetcache_close();
+    free(frameUs);
+    free(allFrameUs);
+
+    return 0;
+}
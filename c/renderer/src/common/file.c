@@ -6,16 +6,46 @@
  *
  */
 
+#if !MSDOS && !defined(_WIN32)
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <assert.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include "common/file.h"
 
+// Whether files can be memory-mapped and read positionally (POSIX mmap() and
+// pread()). Otherwise, mappings are read into memory in one go, and positional
+// reads seek first.
+#if !MSDOS && !defined(_WIN32)
+    #include <sys/mman.h>
+    #include <unistd.h>
+    #include <pthread.h>
+
+    #define KFILE_POSIX 1
+#else
+    #define KFILE_POSIX 0
+#endif
+
 #define k_assert(condition, errorMessage) assert(condition && errorMessage)
 
 // Pre-reserve some room for file handles.
 #define FH_CACHE_SIZE 15
 static FILE *FILE_HANDLE_CACHE[FH_CACHE_SIZE] = {NULL};
 
+#if KFILE_POSIX
+    // Guards the assignment of handles in FILE_HANDLE_CACHE, so that files can
+    // be opened and closed from more than one thread.
+    static pthread_mutex_t FH_CACHE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+    #define lock_handle_cache() pthread_mutex_lock(&FH_CACHE_MUTEX)
+    #define unlock_handle_cache() pthread_mutex_unlock(&FH_CACHE_MUTEX)
+#else
+    #define lock_handle_cache()
+    #define unlock_handle_cache()
+#endif
+
 int is_a_valid_handle(const file_handle_t h)
 {
     return ((h < FH_CACHE_SIZE) &&
@@ -208,9 +238,12 @@ uint32_t kfile_file_size(const file_handle_t handle)
 //
 file_handle_t kfile_open_file(const char *const filename, const char *const mode)
 {
+    lock_handle_cache();
     file_handle_t h = f_next_free_handle();
 
     FILE_HANDLE_CACHE[h] = fopen(filename, mode);
+    unlock_handle_cache();
+
     k_assert((FILE_HANDLE_CACHE[h] != NULL), "Failed to open the given file. Is it read-only?");
 
     return h;
@@ -249,7 +282,137 @@ void kfile_close_file(const file_handle_t handle)
     k_assert((cl == 0), "Failed to close the given file.");
 
     k_assert(is_a_valid_handle(handle), "Can't operate on an inactive file handle.");
+    lock_handle_cache();
     FILE_HANDLE_CACHE[handle] = NULL;
+    unlock_handle_cache();
+
+    return;
+}
+
+// Reads the given number of bytes starting at the given byte offset in the
+// file. Where pread() is available, the file's position isn't used or changed,
+// so different threads can read the same file at once.
+//
+void kfile_read_at(uint8_t *dst, const size_t numBytes, const uint32_t pos, const file_handle_t handle)
+{
+    FILE *const f = kfile_exposed_file_handle(handle);
+
+    #if KFILE_POSIX
+        size_t numRead = 0;
+
+        while (numRead < numBytes)
+        {
+            const ssize_t r = pread(fileno(f), (dst + numRead), (numBytes - numRead), (pos + numRead));
+
+            k_assert((r > 0), "Failed to read bytes from the file.");
+
+            numRead += r;
+        }
+    #else
+        const int s = fseek(f, pos, SEEK_SET);
+        k_assert((s == 0), "Failed to seek to the given file position.");
+
+        const size_t r = fread(dst, 1, numBytes, f);
+        k_assert((r == numBytes), "Failed to read bytes from the file.");
+    #endif
+
+    return;
+}
+
+// Maps the given range of the given file for kfile_map_file() and
+// kfile_map_file_private(). If writable, the mapping is a private copy of the
+// file's contents.
+//
+static struct kfile_mapping_s map_file(const char *const filename, const uint32_t offset, uint32_t numBytes, const int writable)
+{
+    struct kfile_mapping_s mapping;
+    const file_handle_t handle = kfile_open_file(filename, "rb");
+    const uint32_t fileSize = kfile_file_size(handle);
+
+    k_assert((offset <= fileSize), "Attempting to map past the end of the file.");
+
+    if (numBytes == KFILE_REST_OF_FILE)
+    {
+        numBytes = (fileSize - offset);
+    }
+
+    k_assert((numBytes <= (fileSize - offset)), "Attempting to map past the end of the file.");
+
+    mapping.size = numBytes;
+    mapping.base = NULL;
+    mapping.baseSize = 0;
+    mapping.isMapped = 0;
+
+    #if KFILE_POSIX
+        // mmap() wants the offset aligned to the page size, so we map from the
+        // page the range starts in.
+        if (numBytes)
+        {
+            const uint32_t pageOffset = (offset % (uint32_t)sysconf(_SC_PAGESIZE));
+            void *const base = mmap(NULL, (numBytes + pageOffset), (writable? (PROT_READ | PROT_WRITE) : PROT_READ), MAP_PRIVATE,
+                                    fileno(kfile_exposed_file_handle(handle)), (offset - pageOffset));
+
+            if (base != MAP_FAILED)
+            {
+                mapping.base = base;
+                mapping.baseSize = (numBytes + pageOffset);
+                mapping.data = ((const uint8_t*)base + pageOffset);
+                mapping.isMapped = 1;
+            }
+        }
+    #endif
+
+    if (!mapping.isMapped)
+    {
+        mapping.base = malloc(numBytes? numBytes : 1);
+        mapping.baseSize = numBytes;
+        mapping.data = mapping.base;
+
+        k_assert((mapping.base != NULL), "Failed to allocate memory for the file's contents.");
+
+        kfile_read_at(mapping.base, numBytes, offset, handle);
+    }
+
+    kfile_close_file(handle);
+
+    return mapping;
+}
+
+// Returns a read-only view of the given number of bytes of the given file,
+// starting at the given byte offset; or, if the number of bytes is
+// KFILE_REST_OF_FILE, of the rest of the file. The range must lie within the
+// file. The view stays valid until released with kfile_unmap_file(), regardless
+// of whether the file remains open.
+//
+struct kfile_mapping_s kfile_map_file(const char *const filename, const uint32_t offset, uint32_t numBytes)
+{
+    return map_file(filename, offset, numBytes, 0);
+}
+
+// As kfile_map_file(), but the view's data may be modified (through
+// mapping.base). The modifications aren't carried through to the file.
+//
+struct kfile_mapping_s kfile_map_file_private(const char *const filename, const uint32_t offset, uint32_t numBytes)
+{
+    return map_file(filename, offset, numBytes, 1);
+}
+
+void kfile_unmap_file(struct kfile_mapping_s *const mapping)
+{
+    #if KFILE_POSIX
+        if (mapping->isMapped)
+        {
+            munmap(mapping->base, mapping->baseSize);
+        }
+        else
+    #endif
+    {
+        free(mapping->base);
+    }
+
+    mapping->data = NULL;
+    mapping->base = NULL;
+    mapping->size = mapping->baseSize = 0;
 
     return;
 }
@@ -12,6 +12,32 @@
 
 typedef unsigned file_handle_t;
 
+// A read-only view of a range of a file's contents, as returned by
+// kfile_map_file(). The file is memory-mapped where possible, and read into
+// memory otherwise.
+struct kfile_mapping_s
+{
+    const uint8_t *data;
+    uint32_t size;
+
+    // For kfile_unmap_file().
+    void *base;
+    uint32_t baseSize;
+    int isMapped;
+};
+
+// Passed to kfile_map_file() as the number of bytes to map everything from the
+// given offset to the end of the file.
+#define KFILE_REST_OF_FILE 0xffffffffl
+
+struct kfile_mapping_s kfile_map_file(const char *const filename, const uint32_t offset, uint32_t numBytes);
+
+struct kfile_mapping_s kfile_map_file_private(const char *const filename, const uint32_t offset, uint32_t numBytes);
+
+void kfile_unmap_file(struct kfile_mapping_s *const mapping);
+
+void kfile_read_at(uint8_t *dst, const size_t numBytes, const uint32_t pos, const file_handle_t handle);
+
 file_handle_t kfile_open_file(const char *const filename, const char *const mode);
 
 void kfile_close_file(const file_handle_t handle);
@@ -0,0 +1,29 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ */
+
+#if !MSDOS
+    #define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <assert.h>
+#include <time.h>
+#include "common/timer.h"
+
+uint64_t ktimer_now_us(void)
+{
+    #if MSDOS
+        // DOS has no monotonic clock to speak of, so we settle for clock()'s
+        // resolution (roughly 55 ms on a stock PIT).
+        return ((uint64_t)clock() * 1000000 / CLOCKS_PER_SEC);
+    #else
+        struct timespec ts;
+        const int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert((r == 0) && "Failed to query the monotonic clock.");
+
+        return (((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+    #endif
+}
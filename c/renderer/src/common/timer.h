@@ -0,0 +1,20 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ * A monotonic high-resolution clock, for timing frames.
+ * 
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Returns the current value, in microseconds, of a monotonic clock. The value
+// has no defined starting point, so it's only meaningful relative to other
+// values returned by this function.
+uint64_t ktimer_now_us(void);
+
+#endif
@@ -7,36 +7,54 @@
 
 #include <assert.h>
 #include <stdio.h>
-#include <time.h>
 #include <math.h>
 #include "common/genstack.h"
+#include "common/timer.h"
 #include "assets/mesh.h"
 #include "assets/ground.h"
+#include "assets/assetcache.h"
+#include "common/file.h"
 #include "renderer/renderer.h"
+#include "renderer/framesink.h"
 #include "renderer/polygon.h"
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    kassetcache_open();
     ktexture_initialize_textures();
     kmesh_initialize_meshes();
     kground_initialize_ground(3);
     krender_initialize();
     krender_use_palette(0);
 
-    time_t startTime = time(NULL);
+    // If given a filename on the command line, write the rendered frames into
+    // it as a PPM stream.
+    file_handle_t outputHandle = 0;
+    if (argc > 1)
+    {
+        outputHandle = kfile_open_file(argv[1], "wb");
+        krender_set_frame_sink(kframesink_ppm, &outputHandle);
+    }
+
+    const uint64_t startTime = ktimer_now_us();
     unsigned numFrames = 0;
 
-    while ((time(NULL) - startTime) < 6)
+    // The camera position, moved each frame for testing purposes. The ground
+    // view for the next position is built while the current one is rendered.
+    float px = 1;
+    float pz = 1;
+    kground_request_ground_mesh(px, pz);
+
+    while ((ktimer_now_us() - startTime) < 6000000)
     {
         krender_clear_surface();
         
-        // Move the camera, for testing purposes.
+        // Take over the view built during the previous frame, and have the
+        // next one built while this one is rendered.
         {
-            static float px = 1;
-            static float pz = 1;
-        
-            kground_update_ground_mesh(px, pz);
+            kground_swap_ground_mesh();
             pz += 0.25;
+            kground_request_ground_mesh(px, pz);
         }
 
         // Render the ground.
@@ -54,13 +72,26 @@ int main(void)
         numFrames++;
     }
 
-    printf("~%d FPS\n", (int)round(numFrames / (float)(time(NULL) - startTime)));
-    getchar();
+    printf("~%d FPS\n", (int)round(numFrames / ((ktimer_now_us() - startTime) / 1000000.0)));
 
+    if (argc > 1)
+    {
+        krender_set_frame_sink(NULL, NULL);
+        kfile_close_file(outputHandle);
+    }
+
+    // There's no window to look at in headless mode, so don't wait around.
+    #if !RENDER_HEADLESS
+        getchar();
+    #endif
+
+    // Release the ground first, since the view requested on the last frame
+    // may still be being built from the meshes and textures.
+    kground_release_ground();
     kmesh_release_meshes();
     ktexture_release_textures();
-    kground_release_ground();
     krender_release();
+    kassetcache_close();
 
     return 0;
 }
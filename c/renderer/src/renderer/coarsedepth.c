@@ -0,0 +1,121 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ *
+ * Software: Render test for replicating Rally-Sport's rendering.
+ *
+ * A coarse depth buffer, for rejecting spans and polygons that are hidden
+ * behind what's already been drawn without testing their pixels one by one.
+ * Each scanline of the depth buffer is divided into segments of
+ * COARSE_DEPTH_WIDTH pixels, and for each segment we keep a lower bound of the
+ * depth values in it. Since a polygon has a single depth, and is only drawn
+ * over pixels farther away than it (of a lower depth value), a span or a
+ * screen-space bounding box whose segments' bounds are all at least the
+ * polygon's depth can't draw anything.
+ *
+ * The bounds are raised when a span that writes every one of its pixels (i.e.
+ * of an opaque polygon) covers a segment in full, after which each of the
+ * segment's pixels is at least as near as the polygon. They're reset whenever
+ * the depth buffer is, including when it's only marked stale (depthepoch.c).
+ *
+ * NOTE: This file expects to be #included in renderer.c.
+ *
+ */
+
+#define COARSE_DEPTH_SHIFT 4
+#define COARSE_DEPTH_WIDTH (1 << COARSE_DEPTH_SHIFT)
+
+// The segments' lower depth bounds, row by row.
+static uint8_t *COARSE_DEPTH;
+static unsigned NUM_COARSE_DEPTHS_PER_ROW;
+
+static void init_coarse_depth(void)
+{
+    assert(!(GRAPHICS_MODE_WIDTH % COARSE_DEPTH_WIDTH) && "The screen width must be a multiple of the coarse depth segment width.");
+
+    NUM_COARSE_DEPTHS_PER_ROW = (GRAPHICS_MODE_WIDTH / COARSE_DEPTH_WIDTH);
+    COARSE_DEPTH = calloc((NUM_COARSE_DEPTHS_PER_ROW * GRAPHICS_MODE_HEIGHT), sizeof(*COARSE_DEPTH));
+
+    assert(COARSE_DEPTH && "Failed to allocate memory for the coarse depth buffer.");
+
+    return;
+}
+
+static void release_coarse_depth(void)
+{
+    free(COARSE_DEPTH);
+
+    return;
+}
+
+// Call when the depth buffer is cleared or starts a new epoch.
+static void clear_coarse_depth(void)
+{
+    memset(COARSE_DEPTH, 0, (NUM_COARSE_DEPTHS_PER_ROW * GRAPHICS_MODE_HEIGHT));
+
+    return;
+}
+
+// Returns true if a polygon of the given depth would fail the depth test on
+// every pixel of the given scanline from pixel startX up to but not including
+// endX.
+static int is_span_occluded(const unsigned y,
+                            const unsigned startX,
+                            const unsigned endX,
+                            const uint8_t polyDepth)
+{
+    const uint8_t *const bounds = &COARSE_DEPTH[y * NUM_COARSE_DEPTHS_PER_ROW];
+    const unsigned lastSegment = ((endX - 1) >> COARSE_DEPTH_SHIFT);
+
+    for (unsigned s = (startX >> COARSE_DEPTH_SHIFT); s <= lastSegment; s++)
+    {
+        if (bounds[s] < polyDepth)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Returns true if a polygon of the given depth would fail the depth test on
+// every pixel of the given screen rectangle, whose right and bottom edges are
+// exclusive.
+static int is_area_occluded(const unsigned startX,
+                            const unsigned startY,
+                            const unsigned endX,
+                            const unsigned endY,
+                            const uint8_t polyDepth)
+{
+    for (unsigned y = startY; y < endY; y++)
+    {
+        if (!is_span_occluded(y, startX, endX, polyDepth))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Call after a span of the given depth has been filled on the given scanline
+// from pixel startX up to but not including endX, with each of its pixels
+// either drawn or already nearer than the span.
+static void update_coarse_depth(const unsigned y,
+                                const unsigned startX,
+                                const unsigned endX,
+                                const uint8_t polyDepth)
+{
+    uint8_t *const bounds = &COARSE_DEPTH[y * NUM_COARSE_DEPTHS_PER_ROW];
+    const unsigned endSegment = (endX >> COARSE_DEPTH_SHIFT);
+
+    // Only segments that the span covers in full.
+    for (unsigned s = ((startX + COARSE_DEPTH_WIDTH - 1) >> COARSE_DEPTH_SHIFT); s < endSegment; s++)
+    {
+        if (bounds[s] < polyDepth)
+        {
+            bounds[s] = polyDepth;
+        }
+    }
+
+    return;
+}
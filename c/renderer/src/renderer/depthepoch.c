@@ -0,0 +1,153 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ *
+ * Software: Render test for replicating Rally-Sport's rendering.
+ *
+ * Lets the render and depth buffers go uncleared between frames. Each scanline
+ * of the depth buffer is tagged with the frame (epoch) in which it was last
+ * cleared. Clearing the depth buffer then just starts a new epoch; a scanline
+ * whose tag is from an older epoch holds stale depth values and is cleared
+ * when a span first reaches it in the current epoch, while it's about to be
+ * worked on anyway. Scanlines that nothing is drawn on aren't cleared at all.
+ *
+ * Since a pixel that's drawn gets a non-zero depth, the depth buffer also tells
+ * which pixels of the current frame have been drawn. This lets the render
+ * buffer's clear be deferred to the end of the frame as well, when only the
+ * pixels that weren't drawn need to be cleared. Scanlines that were drawn into
+ * in full are found with a read-only pass and left alone.
+ *
+ * NOTE: This file expects to be #included in renderer.c, after coarsedepth.c.
+ *
+ */
+
+// The depth buffer scanlines' epoch tags.
+static uint8_t *DEPTH_ROW_EPOCHS;
+
+// The current epoch. Never 0, so that the tags' initial value of 0 is stale.
+static uint8_t DEPTH_EPOCH = 1;
+
+// How the render and depth buffers are cleared (KRENDER_CLEAR_MODE_x).
+static unsigned CLEAR_MODE = KRENDER_CLEAR_MODE_FULL;
+
+// Set if the render buffer's clear has been deferred until the frame is done
+// (KRENDER_CLEAR_MODE_EPOCH).
+static int COLOR_CLEAR_PENDING = 0;
+
+static void init_depth_epochs(void)
+{
+    DEPTH_ROW_EPOCHS = calloc(GRAPHICS_MODE_HEIGHT, sizeof(*DEPTH_ROW_EPOCHS));
+    DEPTH_EPOCH = 1;
+    COLOR_CLEAR_PENDING = 0;
+
+    assert(DEPTH_ROW_EPOCHS && "Failed to allocate memory for the depth buffer's epochs.");
+
+    return;
+}
+
+static void release_depth_epochs(void)
+{
+    free(DEPTH_ROW_EPOCHS);
+
+    return;
+}
+
+// Marks the depth buffer as cleared for the current epoch, after it's been
+// cleared in full.
+static void mark_depth_rows_current(void)
+{
+    memset(DEPTH_ROW_EPOCHS, DEPTH_EPOCH, GRAPHICS_MODE_HEIGHT);
+
+    return;
+}
+
+// Starts a new epoch, making all of the depth buffer stale.
+static void advance_depth_epoch(void)
+{
+    clear_coarse_depth();
+
+    if (++DEPTH_EPOCH == 0)
+    {
+        memset(DEPTH_ROW_EPOCHS, 0, GRAPHICS_MODE_HEIGHT);
+        DEPTH_EPOCH = 1;
+    }
+
+    return;
+}
+
+// Clears the given scanline of the depth buffer if it's stale, ahead of a
+// depth-tested span being filled on it.
+static void prepare_depth_row(const unsigned y)
+{
+    if (DEPTH_ROW_EPOCHS[y] != DEPTH_EPOCH)
+    {
+        memset(&DEPTH_BUFFER_XY(0, y), 0, GRAPHICS_MODE_WIDTH);
+        DEPTH_ROW_EPOCHS[y] = DEPTH_EPOCH;
+    }
+
+    return;
+}
+
+// Returns a word whose bytes' high bits are set where the given word's bytes
+// are non-zero, and whose other bits are clear.
+static uint32_t nonzero_bytes(const uint32_t word)
+{
+    return ((((word & 0x7f7f7f7ful) + 0x7f7f7f7ful) | word) & 0x80808080ul);
+}
+
+// Clears the pixels of the render buffer that haven't been drawn into in the
+// current epoch. Completes a clear deferred by krender_clear_surface(). The
+// pixels are handled four at a time, a word each from the render and depth
+// buffers.
+static void clear_undrawn_pixels(void)
+{
+    for (unsigned y = 0; y < GRAPHICS_MODE_HEIGHT; y++)
+    {
+        uint8_t *const pixels = &VRAM_XY(0, y);
+        const uint8_t *const depth = &DEPTH_BUFFER_XY(0, y);
+        uint32_t drawn = 0x80808080ul;
+
+        if (DEPTH_ROW_EPOCHS[y] != DEPTH_EPOCH)
+        {
+            memset(pixels, 0, GRAPHICS_MODE_WIDTH);
+            continue;
+        }
+
+        for (unsigned x = 0; x < GRAPHICS_MODE_WIDTH; x += 4)
+        {
+            uint32_t depthWord;
+            memcpy(&depthWord, &depth[x], 4);
+
+            drawn &= nonzero_bytes(depthWord);
+        }
+
+        // Leave scanlines that were drawn into in full alone.
+        if (drawn == 0x80808080ul)
+        {
+            continue;
+        }
+
+        for (unsigned x = 0; x < GRAPHICS_MODE_WIDTH; x += 4)
+        {
+            uint32_t depthWord, pixelWord;
+            memcpy(&depthWord, &depth[x], 4);
+            memcpy(&pixelWord, &pixels[x], 4);
+
+            pixelWord &= ((nonzero_bytes(depthWord) >> 7) * 0xffu);
+            memcpy(&pixels[x], &pixelWord, 4);
+        }
+    }
+
+    return;
+}
+
+// Completes the render buffer's clear if it's been deferred.
+static void finish_deferred_clear(void)
+{
+    if (COLOR_CLEAR_PENDING)
+    {
+        clear_undrawn_pixels();
+        COLOR_CLEAR_PENDING = 0;
+    }
+
+    return;
+}
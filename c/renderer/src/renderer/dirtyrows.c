@@ -0,0 +1,151 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ *
+ * Software: Render test for replicating Rally-Sport's rendering.
+ *
+ * Keeps track of which scanlines of the render buffer have changed since the
+ * previous frame was presented, so that krender_flip_surface() only needs to
+ * copy, convert and upload those. Filling a span marks its scanline, and
+ * clearing the render buffer marks the scanlines that weren't blank when last
+ * presented. At flip time, the marked scanlines are compared against a copy of
+ * the previously presented frame, and only those that differ are presented.
+ *
+ * NOTE: This file expects to be #included in renderer.c.
+ *
+ */
+
+// Flags in ROW_FLAGS.
+enum
+{
+    // The scanline has been filled into since the render buffer was last
+    // cleared. If not, it's all 0.
+    ROW_FILLED = (1 << 0),
+
+    // The scanline may differ from its copy in PRESENTED_BUFFER.
+    ROW_CHANGED = (1 << 1),
+
+    // The scanline's copy in PRESENTED_BUFFER is all 0.
+    ROW_PRESENTED_BLANK = (1 << 2),
+
+    // The scanline differed from its copy in PRESENTED_BUFFER at the last
+    // flip, and so is being presented.
+    ROW_DIRTY = (1 << 3)
+};
+
+// A copy of the most recently presented frame.
+static uint8_t *PRESENTED_BUFFER;
+
+// For each scanline, a combination of the ROW_x flags.
+static uint8_t *ROW_FLAGS;
+
+// If set, all scanlines are presented at the next flip, changed or not; e.g.
+// because the palette or the frame's recipient has changed.
+static int ALL_ROWS_CHANGED = 1;
+
+static void init_dirty_rows(void)
+{
+    PRESENTED_BUFFER = calloc((GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT), sizeof(*PRESENTED_BUFFER));
+    ROW_FLAGS = calloc(GRAPHICS_MODE_HEIGHT, sizeof(*ROW_FLAGS));
+    ALL_ROWS_CHANGED = 1;
+
+    assert((PRESENTED_BUFFER && ROW_FLAGS) && "Failed to allocate memory for tracking changed scanlines.");
+
+    return;
+}
+
+static void release_dirty_rows(void)
+{
+    free(PRESENTED_BUFFER);
+    free(ROW_FLAGS);
+
+    return;
+}
+
+// Makes the next flip present every scanline.
+static void invalidate_presented_rows(void)
+{
+    ALL_ROWS_CHANGED = 1;
+
+    return;
+}
+
+// Call when the given scanline of the render buffer is filled into.
+static void mark_row_filled(const unsigned y)
+{
+    ROW_FLAGS[y] |= (ROW_FILLED | ROW_CHANGED);
+
+    return;
+}
+
+// Call when the render buffer is cleared to 0.
+static void mark_rows_cleared(void)
+{
+    for (unsigned y = 0; y < GRAPHICS_MODE_HEIGHT; y++)
+    {
+        const uint8_t wasBlank = (ROW_FLAGS[y] & ROW_PRESENTED_BLANK);
+
+        ROW_FLAGS[y] = (wasBlank? ROW_PRESENTED_BLANK : ROW_CHANGED);
+    }
+
+    return;
+}
+
+// Finds which scanlines of the render buffer differ from the previously
+// presented frame, marks them ROW_DIRTY and copies them into PRESENTED_BUFFER.
+// Returns the number of such scanlines.
+static unsigned update_dirty_rows(void)
+{
+    unsigned numDirty = 0;
+
+    for (unsigned y = 0; y < GRAPHICS_MODE_HEIGHT; y++)
+    {
+        const uint8_t flags = ROW_FLAGS[y];
+        uint8_t *const presentedRow = &PRESENTED_BUFFER[y * GRAPHICS_MODE_WIDTH];
+        int isDirty = ALL_ROWS_CHANGED;
+
+        if (!isDirty && (flags & ROW_CHANGED))
+        {
+            isDirty = (memcmp(&VRAM_XY(0, y), presentedRow, GRAPHICS_MODE_WIDTH) != 0);
+        }
+
+        if (isDirty)
+        {
+            memcpy(presentedRow, &VRAM_XY(0, y), GRAPHICS_MODE_WIDTH);
+            numDirty++;
+        }
+
+        // A scanline that hasn't been filled into since the last clear is
+        // known to be blank; one that has may or may not be.
+        ROW_FLAGS[y] = ((flags & ROW_FILLED) |
+                        ((flags & ROW_FILLED)? 0 : ROW_PRESENTED_BLANK) |
+                        (isDirty? ROW_DIRTY : 0));
+    }
+
+    ALL_ROWS_CHANGED = 0;
+
+    return numDirty;
+}
+
+#if !RENDER_HEADLESS
+
+// Finds the first run of consecutive dirty scanlines at or below *y. Returns
+// false if there are none; otherwise, sets *y to the run's first scanline and
+// *numRows to its length, and returns true.
+static int next_dirty_rows(unsigned *const y, unsigned *const numRows)
+{
+    while ((*y < GRAPHICS_MODE_HEIGHT) && !(ROW_FLAGS[*y] & ROW_DIRTY))
+    {
+        (*y)++;
+    }
+
+    *numRows = 0;
+
+    while (((*y + *numRows) < GRAPHICS_MODE_HEIGHT) && (ROW_FLAGS[*y + *numRows] & ROW_DIRTY))
+    {
+        (*numRows)++;
+    }
+
+    return (*numRows != 0);
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include "common/file.h"
+#include "renderer/framesink.h"
+#include "renderer/renderer.h"
+
+void kframesink_memory(const uint8_t *const pixels,
+                       const unsigned width,
+                       const unsigned height,
+                       const uint8_t (*const palette)[3],
+                       void *const userData)
+{
+    assert(userData && "No buffer to copy the frame into.");
+
+    memcpy(userData, pixels, (width * height));
+
+    (void)palette;
+
+    return;
+}
+
+void kframesink_memory_changes(const uint8_t *const pixels,
+                               const unsigned width,
+                               const unsigned height,
+                               const uint8_t (*const palette)[3],
+                               void *const userData)
+{
+    assert(userData && "No buffer to copy the frame into.");
+
+    for (unsigned y = 0; y < height; y++)
+    {
+        if (krender_row_changed(y))
+        {
+            memcpy(((uint8_t*)userData + (y * width)), (pixels + (y * width)), width);
+        }
+    }
+
+    (void)palette;
+
+    return;
+}
+
+void kframesink_raw(const uint8_t *const pixels,
+                    const unsigned width,
+                    const unsigned height,
+                    const uint8_t (*const palette)[3],
+                    void *const userData)
+{
+    assert(userData && "No file to write the frame into.");
+
+    kfile_write_byte_array(pixels, (width * height), *(file_handle_t*)userData);
+
+    (void)palette;
+
+    return;
+}
+
+// The number of pixels kframesink_ppm() converts to RGB at a time; enough for
+// one row of the renderer's frame, so that rows are written out whole.
+#define PPM_CHUNK_SIZE 320
+
+void kframesink_ppm(const uint8_t *const pixels,
+                    const unsigned width,
+                    const unsigned height,
+                    const uint8_t (*const palette)[3],
+                    void *const userData)
+{
+    uint8_t rgb[PPM_CHUNK_SIZE * 3];
+
+    assert(userData && "No file to write the frame into.");
+    assert(palette && "Can't produce RGB output without a palette.");
+
+    const file_handle_t handle = *(file_handle_t*)userData;
+
+    {
+        char header[32];
+        sprintf(header, "P6\n%u %u\n255\n", width, height);
+
+        kfile_write_string(header, handle);
+    }
+
+    for (unsigned y = 0; y < height; y++)
+    {
+        const uint8_t *const row = (pixels + (y * width));
+
+        for (unsigned x = 0; x < width; x += PPM_CHUNK_SIZE)
+        {
+            const unsigned chunkWidth = (((width - x) < PPM_CHUNK_SIZE)? (width - x) : PPM_CHUNK_SIZE);
+
+            for (unsigned i = 0; i < chunkWidth; i++)
+            {
+                rgb[(i * 3) + 0] = palette[row[x + i]][0];
+                rgb[(i * 3) + 1] = palette[row[x + i]][1];
+                rgb[(i * 3) + 2] = palette[row[x + i]][2];
+            }
+
+            kfile_write_byte_array(rgb, (chunkWidth * 3), handle);
+        }
+    }
+
+    return;
+}
@@ -0,0 +1,50 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ * Ready-made frame sinks for use with krender_set_frame_sink().
+ * 
+ */
+
+#ifndef FRAMESINK_H
+#define FRAMESINK_H
+
+#include <stdint.h>
+
+// Copies the frame's palette indices into the buffer pointed to by userData,
+// which must have room for at least width * height bytes.
+void kframesink_memory(const uint8_t *const pixels,
+                       const unsigned width,
+                       const unsigned height,
+                       const uint8_t (*const palette)[3],
+                       void *const userData);
+
+// As kframesink_memory(), but copies only the scanlines that have changed since
+// the previous frame (see krender_row_changed()), leaving the rest of the buffer
+// as it was. So the buffer must have received every frame since this sink was
+// set.
+void kframesink_memory_changes(const uint8_t *const pixels,
+                               const unsigned width,
+                               const unsigned height,
+                               const uint8_t (*const palette)[3],
+                               void *const userData);
+
+// Appends the frame's palette indices, as-is, into the file whose handle
+// (file_handle_t) is pointed to by userData.
+void kframesink_raw(const uint8_t *const pixels,
+                    const unsigned width,
+                    const unsigned height,
+                    const uint8_t (*const palette)[3],
+                    void *const userData);
+
+// Appends the frame as a binary (P6) PPM image into the file whose handle
+// (file_handle_t) is pointed to by userData. Consecutive frames form a
+// multi-image PPM stream. Requires the frame's palette to be available.
+void kframesink_ppm(const uint8_t *const pixels,
+                    const unsigned width,
+                    const unsigned height,
+                    const uint8_t (*const palette)[3],
+                    void *const userData);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ *
+ * Software: Render test for replicating Rally-Sport's rendering.
+ *
+ * Converts the render buffer's palette indices into the 32-bit ABGR8888 pixels
+ * of the SDL texture. Each index is looked up in a table of the palette's
+ * colors packed into 32 bits, so that a pixel is a single load and store. The
+ * table is rebuilt whenever the palette changes.
+ *
+ * NOTE: This file expects to be #included in renderer.c.
+ *
+ */
+
+#if !MSDOS && !RENDER_HEADLESS
+
+// PALETTE's colors as ABGR8888 pixels, i.e. with red in the lowest byte and an
+// opaque alpha in the highest.
+static uint32_t PALETTE_ABGR[256];
+
+// If set, pixels will be converted with convert_pixels_reference().
+static int USE_REFERENCE_CONVERSION = 0;
+
+static uint32_t abgr_pixel(const uint8_t *const rgb)
+{
+    return ((0xffu << 24) | ((uint32_t)rgb[2] << 16) | ((uint32_t)rgb[1] << 8) | rgb[0]);
+}
+
+static void update_packed_palette(void)
+{
+    for (unsigned i = 0; i < 256; i++)
+    {
+        PALETTE_ABGR[i] = abgr_pixel(PALETTE[i]);
+    }
+
+    return;
+}
+
+// Converts the given palette indices into ABGR8888 pixels one channel at a
+// time directly from PALETTE. Slow, but doesn't depend on PALETTE_ABGR, so
+// serves as a reference for convert_pixels().
+static void convert_pixels_reference(const uint8_t *const src, uint32_t *const dst, const unsigned numPixels)
+{
+    for (unsigned i = 0; i < numPixels; i++)
+    {
+        dst[i] = abgr_pixel(PALETTE[src[i]]);
+    }
+
+    return;
+}
+
+// Converts the given palette indices into ABGR8888 pixels via PALETTE_ABGR,
+// eight pixels per iteration.
+static void convert_pixels(const uint8_t *const src, uint32_t *const dst, const unsigned numPixels)
+{
+    unsigned i = 0;
+
+    if (USE_REFERENCE_CONVERSION)
+    {
+        convert_pixels_reference(src, dst, numPixels);
+        return;
+    }
+
+    for (; (i + 8) <= numPixels; i += 8)
+    {
+        const uint32_t p0 = PALETTE_ABGR[src[i + 0]];
+        const uint32_t p1 = PALETTE_ABGR[src[i + 1]];
+        const uint32_t p2 = PALETTE_ABGR[src[i + 2]];
+        const uint32_t p3 = PALETTE_ABGR[src[i + 3]];
+        const uint32_t p4 = PALETTE_ABGR[src[i + 4]];
+        const uint32_t p5 = PALETTE_ABGR[src[i + 5]];
+        const uint32_t p6 = PALETTE_ABGR[src[i + 6]];
+        const uint32_t p7 = PALETTE_ABGR[src[i + 7]];
+
+        dst[i + 0] = p0;
+        dst[i + 1] = p1;
+        dst[i + 2] = p2;
+        dst[i + 3] = p3;
+        dst[i + 4] = p4;
+        dst[i + 5] = p5;
+        dst[i + 6] = p6;
+        dst[i + 7] = p7;
+    }
+
+    for (; i < numPixels; i++)
+    {
+        dst[i] = PALETTE_ABGR[src[i]];
+    }
+
+    return;
+}
+
+// Converts the given scanlines of the render buffer into the given pixels,
+// whose rows are 'pitch' bytes apart.
+static void convert_render_rows(uint8_t *const pixels,
+                                const unsigned pitch,
+                                const unsigned firstRow,
+                                const unsigned numRows)
+{
+    if (pitch == (GRAPHICS_MODE_WIDTH * sizeof(uint32_t)))
+    {
+        convert_pixels(&VRAM_XY(0, firstRow), (uint32_t*)pixels, (GRAPHICS_MODE_WIDTH * numRows));
+    }
+    else
+    {
+        for (unsigned y = 0; y < numRows; y++)
+        {
+            convert_pixels(&VRAM_XY(0, (firstRow + y)), (uint32_t*)(pixels + (y * pitch)), GRAPHICS_MODE_WIDTH);
+        }
+    }
+
+    return;
+}
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ *
+ * Software: Render test for replicating Rally-Sport's rendering.
+ *
+ * Fills the polygon queue in parallel. The screen is split into horizontal
+ * bands of BAND_HEIGHT scanlines, each queued polygon is binned into the bands
+ * its Y range touches, and a pool of worker threads then fills the bands, each
+ * thread taking the next unfilled band until none remain. A band's polygons are
+ * filled in queue order with their spans clipped to the band, and no two bands
+ * share a pixel, so the result is identical to filling the queue on one thread.
+ *
+ * Threads are available where POSIX threads are (i.e. not in DOS).
+ *
+ * NOTE: This file expects to be #included in renderer.c.
+ *
+ */
+
+#if !MSDOS
+    #include <pthread.h>
+
+    #define RENDER_THREADS 1
+#else
+    #define RENDER_THREADS 0
+#endif
+
+// The maximum number of threads, including the calling thread, that can be
+// asked to fill polygons.
+#define MAX_RENDER_THREADS 64
+
+// The height, in scanlines, of the screen bands filled by the worker threads.
+// Making the bands narrower than the screen height divided by the number of
+// threads lets threads that get light bands (e.g. of sky) take on more.
+#define BAND_HEIGHT 8
+
+// The number of threads, including the calling thread, filling the bands.
+static unsigned NUM_RENDER_THREADS = 1;
+
+#if RENDER_THREADS
+    static unsigned NUM_BANDS = 0;
+
+    // For each band, the indices into POLY_QUEUE of the polygons that touch it,
+    // in the order in which they're to be filled.
+    static struct kelpo_generic_stack_s **BAND_POLYS;
+
+    // For each band, the render stats gathered while filling it, so that the
+    // threads needn't share counters. Added into RENDER_STATS once all bands
+    // have been filled.
+    static struct krender_stats_s *BAND_STATS;
+
+    static pthread_t BAND_WORKERS[MAX_RENDER_THREADS - 1];
+
+    // Guards the band hand-out state below.
+    static pthread_mutex_t BAND_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+    // Signaled when a new frame's bands are ready to be filled, and when the
+    // last of them has been filled.
+    static pthread_cond_t BANDS_READY = PTHREAD_COND_INITIALIZER;
+    static pthread_cond_t BANDS_DONE = PTHREAD_COND_INITIALIZER;
+
+    // Incremented for each set of bands handed out, so the workers can tell a
+    // new set from one they've already worked on.
+    static uint32_t BAND_GENERATION = 0;
+
+    static unsigned NEXT_BAND = 0;
+    static unsigned NUM_BANDS_FILLED = 0;
+    static int BAND_DEPTH_TEST = 1;
+    static int BAND_WORKERS_QUIT = 0;
+
+    static void fill_band(const unsigned bandIdx)
+    {
+        const struct queued_poly_s *const queue = (struct queued_poly_s*)POLY_QUEUE->data;
+        const uint32_t *const polyIdx = (uint32_t*)BAND_POLYS[bandIdx]->data;
+        const int clipTop = (bandIdx * BAND_HEIGHT);
+        int clipBottom = (clipTop + BAND_HEIGHT);
+
+        if (clipBottom > (int)GRAPHICS_MODE_HEIGHT)
+        {
+            clipBottom = GRAPHICS_MODE_HEIGHT;
+        }
+
+        for (uint32_t i = 0; i < BAND_POLYS[bandIdx]->count; i++)
+        {
+            fill_poly(&queue[polyIdx[i]].poly, BAND_DEPTH_TEST, clipTop, clipBottom, &BAND_STATS[bandIdx]);
+        }
+
+        return;
+    }
+
+    // Fills bands until there are none left to take.
+    static void fill_remaining_bands(void)
+    {
+        for (;;)
+        {
+            pthread_mutex_lock(&BAND_MUTEX);
+            const unsigned bandIdx = NEXT_BAND++;
+            pthread_mutex_unlock(&BAND_MUTEX);
+
+            if (bandIdx >= NUM_BANDS)
+            {
+                break;
+            }
+
+            fill_band(bandIdx);
+
+            pthread_mutex_lock(&BAND_MUTEX);
+            if (++NUM_BANDS_FILLED == NUM_BANDS)
+            {
+                pthread_cond_signal(&BANDS_DONE);
+            }
+            pthread_mutex_unlock(&BAND_MUTEX);
+        }
+
+        return;
+    }
+
+    static void* band_worker(void *const unused)
+    {
+        uint32_t generation;
+
+        (void)unused;
+
+        // Only sets of bands handed out after we've started are of interest.
+        pthread_mutex_lock(&BAND_MUTEX);
+        generation = BAND_GENERATION;
+        pthread_mutex_unlock(&BAND_MUTEX);
+
+        for (;;)
+        {
+            pthread_mutex_lock(&BAND_MUTEX);
+            while ((generation == BAND_GENERATION) && !BAND_WORKERS_QUIT)
+            {
+                pthread_cond_wait(&BANDS_READY, &BAND_MUTEX);
+            }
+            generation = BAND_GENERATION;
+            const int quit = BAND_WORKERS_QUIT;
+            pthread_mutex_unlock(&BAND_MUTEX);
+
+            if (quit)
+            {
+                break;
+            }
+
+            fill_remaining_bands();
+        }
+
+        return NULL;
+    }
+
+    // Sorts the queued polygons into the bands their Y ranges touch, in the
+    // order arranged by order_poly_queue().
+    static void bin_poly_queue(void)
+    {
+        const struct queued_poly_s *const queue = (struct queued_poly_s*)POLY_QUEUE->data;
+
+        for (unsigned b = 0; b < NUM_BANDS; b++)
+        {
+            kelpo_generic_stack__clear(BAND_POLYS[b]);
+        }
+
+        for (uint32_t i = 0; i < POLY_QUEUE->count; i++)
+        {
+            const uint32_t idx = POLY_QUEUE_ORDER[i];
+            const struct polygon_s *const poly = &queue[idx].poly;
+            int topY = fixed_coord(poly->verts[0].y);
+            int bottomY = topY;
+
+            for (unsigned v = 1; v < poly->numVerts; v++)
+            {
+                const int y = fixed_coord(poly->verts[v].y);
+
+                if (y < topY) topY = y;
+                if (y > bottomY) bottomY = y;
+            }
+
+            // fill_poly() fills the scanlines from topY up to but not including
+            // bottomY.
+            if (topY < 0) topY = 0;
+            if (bottomY > (int)GRAPHICS_MODE_HEIGHT) bottomY = GRAPHICS_MODE_HEIGHT;
+
+            if (topY >= bottomY)
+            {
+                continue;
+            }
+
+            for (int b = (topY / BAND_HEIGHT); b <= ((bottomY - 1) / BAND_HEIGHT); b++)
+            {
+                kelpo_generic_stack__push_copy(BAND_POLYS[b], &idx);
+            }
+        }
+
+        return;
+    }
+#endif
+
+static void init_poly_bands(void)
+{
+    #if RENDER_THREADS
+        NUM_BANDS = ((GRAPHICS_MODE_HEIGHT + BAND_HEIGHT - 1) / BAND_HEIGHT);
+        NEXT_BAND = NUM_BANDS;
+        BAND_POLYS = malloc(sizeof(*BAND_POLYS) * NUM_BANDS);
+        BAND_STATS = calloc(NUM_BANDS, sizeof(*BAND_STATS));
+
+        assert((BAND_POLYS && BAND_STATS) && "Failed to allocate memory for the screen bands.");
+
+        for (unsigned b = 0; b < NUM_BANDS; b++)
+        {
+            BAND_POLYS[b] = kelpo_generic_stack__create(256, sizeof(uint32_t));
+        }
+    #endif
+
+    return;
+}
+
+// Stops any worker threads, leaving the calling thread to do all filling.
+static void stop_band_workers(void)
+{
+    #if RENDER_THREADS
+        if (NUM_RENDER_THREADS > 1)
+        {
+            pthread_mutex_lock(&BAND_MUTEX);
+            BAND_WORKERS_QUIT = 1;
+            pthread_cond_broadcast(&BANDS_READY);
+            pthread_mutex_unlock(&BAND_MUTEX);
+
+            for (unsigned i = 0; i < (NUM_RENDER_THREADS - 1); i++)
+            {
+                pthread_join(BAND_WORKERS[i], NULL);
+            }
+
+            BAND_WORKERS_QUIT = 0;
+        }
+    #endif
+
+    NUM_RENDER_THREADS = 1;
+
+    return;
+}
+
+// Starts enough worker threads that, together with the calling thread, there
+// are numThreads of them filling bands. Returns the number of threads actually
+// available, which is 1 where threads aren't supported. Any existing workers
+// must have been stopped first.
+static unsigned start_band_workers(unsigned numThreads)
+{
+    assert((NUM_RENDER_THREADS == 1) && "The band workers are already running.");
+
+    #if RENDER_THREADS
+        if (numThreads > MAX_RENDER_THREADS)
+        {
+            numThreads = MAX_RENDER_THREADS;
+        }
+
+        for (; NUM_RENDER_THREADS < numThreads; NUM_RENDER_THREADS++)
+        {
+            if (pthread_create(&BAND_WORKERS[NUM_RENDER_THREADS - 1], NULL, band_worker, NULL) != 0)
+            {
+                break;
+            }
+        }
+    #else
+        (void)numThreads;
+    #endif
+
+    return NUM_RENDER_THREADS;
+}
+
+static void release_poly_bands(void)
+{
+    stop_band_workers();
+
+    #if RENDER_THREADS
+        for (unsigned b = 0; b < NUM_BANDS; b++)
+        {
+            kelpo_generic_stack__free(BAND_POLYS[b]);
+        }
+
+        free(BAND_POLYS);
+        free(BAND_STATS);
+    #endif
+
+    return;
+}
+
+// Fills the queued polygons band by band using the worker threads and the
+// calling thread, in the order arranged by order_poly_queue(). Returns once all
+// bands have been filled.
+static void fill_poly_queue_in_bands(const int depthTest)
+{
+    #if RENDER_THREADS
+        bin_poly_queue();
+
+        pthread_mutex_lock(&BAND_MUTEX);
+        BAND_DEPTH_TEST = depthTest;
+        NEXT_BAND = 0;
+        NUM_BANDS_FILLED = 0;
+        BAND_GENERATION++;
+        pthread_cond_broadcast(&BANDS_READY);
+        pthread_mutex_unlock(&BAND_MUTEX);
+
+        fill_remaining_bands();
+
+        pthread_mutex_lock(&BAND_MUTEX);
+        while (NUM_BANDS_FILLED < NUM_BANDS)
+        {
+            pthread_cond_wait(&BANDS_DONE, &BAND_MUTEX);
+        }
+        pthread_mutex_unlock(&BAND_MUTEX);
+
+        for (unsigned b = 0; b < NUM_BANDS; b++)
+        {
+            RENDER_STATS.numCoarseRejectedPolys += BAND_STATS[b].numCoarseRejectedPolys;
+            RENDER_STATS.numCoarseRejectedPixels += BAND_STATS[b].numCoarseRejectedPixels;
+            memset(&BAND_STATS[b], 0, sizeof(BAND_STATS[b]));
+        }
+    #else
+        fill_poly_queue(depthTest);
+    #endif
+
+    return;
+}
@@ -16,238 +16,407 @@
 // The maximum number of vertices per polygon we support.
 #define MAX_VERTEX_COUNT 16
 
-// Initialize increments for vertical interpolation.
-static void init_lerp_deltas(float *const deltaX,
-                             const int dir,
-                             const unsigned vertexIdx,
-                             const struct vertex_s *const verts)
+// Edges are walked in 16.16 fixed point.
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1l << FIXED_SHIFT)
+
+// Vertex coordinates are clamped to this magnitude when converted to integer
+// for rasterization, so that edge positions and increments in 16.16 fixed
+// point can't overflow 32 bits.
+#define FIXED_COORD_LIMIT 8192
+
+// Initialize the 16.16 fixed-point X position and per-scanline X increment of
+// the edge running from vertex 'from' to vertex 'to'. The increment is divided
+// out rather than looked up, so that the edge lands on the same pixels as with
+// floating-point stepping.
+static void init_edge(int32_t *const x,
+                      int32_t *const deltaX,
+                      const unsigned from,
+                      const unsigned to,
+                      const int *const vertX,
+                      const int *const vertY)
 {
-    // Horizontal edges.
-    if (verts[vertexIdx].y == verts[vertexIdx + dir].y)
-    {
-        *deltaX = 0;
-    }
-    else
-    {
-        const float height = (verts[vertexIdx + dir].y - verts[vertexIdx].y);
+    const int32_t height = (vertY[to] - vertY[from]);
 
-        *deltaX = ((verts[vertexIdx + dir].x - verts[vertexIdx].x) / height);
-    }
+    *x = ((int32_t)vertX[from] * FIXED_ONE);
+
+    // Horizontal edges have no increment.
+    *deltaX = (height? (((int32_t)(vertX[to] - vertX[from]) * FIXED_ONE) / height) : 0);
 
     return;
 }
 
-// Initialize values to be interpolated vertically.
-static void init_lerp_values(float *const x,
-                             const unsigned vertexIdx,
-                             const struct vertex_s *const verts)
+// Converts the given vertex coordinate into an integer that's safe to use in
+// the fixed-point rasterizer. Projected vertices are whole pixels already, so
+// this only clamps them; but should a fraction get through, it's floored, as
+// projection does, rather than truncated toward zero.
+static int fixed_coord(const float coord)
 {
-    *x = verts[vertexIdx].x;
+    if (coord < -FIXED_COORD_LIMIT) return -FIXED_COORD_LIMIT;
+    if (coord > FIXED_COORD_LIMIT) return FIXED_COORD_LIMIT;
 
-    return;
+    return floor(coord);
 }
 
-// For use with qsort() to sort vertices by their Y coordinate.
-int qsort_sort_vertices_by_y(const void *a, const void *b)
+// Compare-and-swap for the sorting networks in sort_by_y(): orders the vertex
+// indices at positions a and b of 'order' by their Y coordinates. Ties are
+// broken by vertex index, which makes the networks behave as a stable sort.
+#define SORT_PAIR(a, b) if ((y[order[a]] > y[order[b]]) ||\
+                            ((y[order[a]] == y[order[b]]) && (order[a] > order[b])))\
+                        {\
+                            const uint8_t tmp = order[a];\
+                            order[a] = order[b];\
+                            order[b] = tmp;\
+                        }
+
+// Sorts the given vertex indices by their vertices' Y coordinates, from lowest
+// to highest (top to bottom on the screen), keeping vertices of equal Y in
+// their original order. Polygons with 3, 4 and 5 vertices are the common case
+// and go through fixed sorting networks; other counts get an insertion sort.
+static void sort_by_y(uint8_t *const order, const int *const y, const unsigned numVerts)
 {
-    if (((struct vertex_s*)a)->y <  ((struct vertex_s*)b)->y)
-    {
-        return -1;
-    }
-    else if (((struct vertex_s*)a)->y == ((struct vertex_s*)b)->y)
+    switch (numVerts)
     {
-        return 0;
-    }
-    else
-    {
-        return 1;
+        case 3:
+        {
+            SORT_PAIR(0, 2); SORT_PAIR(0, 1); SORT_PAIR(1, 2);
+            break;
+        }
+        case 4:
+        {
+            SORT_PAIR(0, 1); SORT_PAIR(2, 3); SORT_PAIR(0, 2); SORT_PAIR(1, 3);
+            SORT_PAIR(1, 2);
+            break;
+        }
+        case 5:
+        {
+            SORT_PAIR(0, 1); SORT_PAIR(3, 4); SORT_PAIR(2, 4); SORT_PAIR(2, 3);
+            SORT_PAIR(0, 3); SORT_PAIR(0, 2); SORT_PAIR(1, 4); SORT_PAIR(1, 3);
+            SORT_PAIR(1, 2);
+            break;
+        }
+        default:
+        {
+            for (unsigned i = 1; i < numVerts; i++)
+            {
+                const uint8_t idx = order[i];
+                unsigned j = i;
+
+                for (; (j > 0) && (y[order[j - 1]] > y[idx]); j--)
+                {
+                    order[j] = order[j - 1];
+                }
+
+                order[j] = idx;
+            }
+
+            break;
+        }
     }
+
+    return;
 }
 
-// Sorts the polygon's vertices in counter-clockwise order, starting from the
-// top (lowest Y) and winding around the polygon back to the top.
-static int sort_vertices_ccw(struct polygon_s *poly)
+#undef SORT_PAIR
+
+// Writes the polygon's vertices into dstX and dstY as integer screen coordinates
+// in counter-clockwise order, starting from the top (lowest Y) and winding
+// around the polygon back to the top. The polygon's own vertices are left
+// untouched. Returns the polygon's height.
+static int sort_vertices_ccw(const struct polygon_s *const poly,
+                              int *const dstX,
+                              int *const dstY)
 {
-    unsigned i;
-    unsigned numLeftVerts = 0;
-    unsigned numRightVerts = 0;
-    static struct vertex_s leftVerts[MAX_VERTEX_COUNT];
-    static struct vertex_s rightVerts[MAX_VERTEX_COUNT];
+    const unsigned numVerts = poly->numVerts;
+    uint8_t order[MAX_VERTEX_COUNT];
+    int x[MAX_VERTEX_COUNT];
+    int y[MAX_VERTEX_COUNT];
 
-    assert((poly->numVerts < MAX_VERTEX_COUNT) && "Too many vertices.");
+    assert(numVerts && "Can't sort the vertices of an empty polygon.");
+    assert((numVerts < MAX_VERTEX_COUNT) && "Too many vertices.");
 
-    if (!poly->numVerts)
+    for (unsigned i = 0; i < numVerts; i++)
     {
-        return 0;
+        x[i] = fixed_coord(poly->verts[i].x);
+        y[i] = fixed_coord(poly->verts[i].y);
+        order[i] = i;
     }
 
-    // Sort verts by Y coordinate from lowest to highest (top to bottom on the
-    // screen).
-    qsort(poly->verts, poly->numVerts, sizeof(poly->verts[0]), qsort_sort_vertices_by_y);
-    
-    struct vertex_s *const topVert = &poly->verts[0];
-    struct vertex_s *const bottomVert = &poly->verts[poly->numVerts - 1];
-    const int polyHeight = (bottomVert->y - topVert->y);
+    sort_by_y(order, y, numVerts);
 
-    leftVerts[numLeftVerts++] = *topVert;
+    const unsigned top = order[0];
+    const unsigned bottom = order[numVerts - 1];
+    const int32_t height = (y[bottom] - y[top]);
+    const int32_t width = (x[bottom] - x[top]);
 
-    for (i = 1; i < (poly->numVerts - 1); i++)
+    // The left chain runs down from the top, filling the destination from its
+    // start; the right chain runs back up from the bottom, filling it from its
+    // end. Each vertex goes to the side of the line from the top vertex to the
+    // bottom vertex that it lies on.
+    unsigned leftIdx = 0;
+    unsigned rightIdx = numVerts;
+
+    dstX[leftIdx] = x[top];
+    dstY[leftIdx] = y[top];
+
+    for (unsigned i = 1; i < (numVerts - 1); i++)
     {
-        const float lr = LERP(topVert->x,
-                              bottomVert->x,
-                              ((poly->verts[i].y - topVert->y) / (bottomVert->y - topVert->y)));
+        const unsigned v = order[i];
 
-        if (poly->verts[i].x < lr)
+        if (((int32_t)(x[v] - x[top]) * height) < ((int32_t)(y[v] - y[top]) * width))
         {
-            leftVerts[numLeftVerts++] = poly->verts[i];
+            leftIdx++;
+            dstX[leftIdx] = x[v];
+            dstY[leftIdx] = y[v];
         }
         else
         {
-            rightVerts[numRightVerts++] = poly->verts[i];
+            rightIdx--;
+            dstX[rightIdx] = x[v];
+            dstY[rightIdx] = y[v];
         }
     }
 
-    leftVerts[numLeftVerts++] = *bottomVert;
-    
-    for (i = 0; i < numLeftVerts; i++)
-    {
-        poly->verts[i] = leftVerts[i];
-    }
+    dstX[leftIdx + 1] = x[bottom];
+    dstY[leftIdx + 1] = y[bottom];
+
+    return height;
+}
 
-    for (i = 0; i < numRightVerts; i++)
+// Returns an estimate of the polygon's average depth, for depth buffering.
+static uint8_t poly_depth(const struct polygon_s *const poly)
+{
+    uint16_t polyDepth = 0;
+
+    for (unsigned i = 0; i < poly->numVerts; i++)
     {
-        poly->verts[i + numLeftVerts] = rightVerts[numRightVerts - i - 1];
+        polyDepth += -poly->verts[i].z;
     }
 
-    return polyHeight;
+    return (polyDepth >> 8); // The depth buffer is 8 bits per pixel.
 }
 
-void fill_poly(struct polygon_s *const poly)
+// Fills the given screen-space polygon into the render buffer. If depthTest is
+// true, the polygon's pixels are tested against and written into the depth
+// buffer; otherwise, the depth buffer isn't touched. Only the scanlines from
+// clipTop up to but not including clipBottom are filled; the rest of the screen
+// is left untouched, so that separate bands of it can be filled independently.
+// The counts of pixels and polygons rejected by the coarse depth test are added
+// into the given stats.
+void fill_poly(const struct polygon_s *const poly,
+               const int depthTest,
+               const int clipTop,
+               const int clipBottom,
+               struct krender_stats_s *const stats)
 {
+    assert(((clipTop >= 0) && (clipBottom <= (int)GRAPHICS_MODE_HEIGHT)) &&
+           "The fill's clip range is off-screen.");
+
     if (!poly->numVerts)
     {
         return;
     }
 
-    const int polyHeight = sort_vertices_ccw(poly);
+    const uint8_t polyDepth = poly_depth(poly);
 
-    // Get an estimate of the polygon's average depth, for depth buffering.
-    uint16_t polyDepth = 0;
-    for (unsigned i = 0; i < poly->numVerts; i++)
+    // A polygon at depth 0 is no nearer than even a cleared pixel, so it would
+    // fail the depth test everywhere.
+    if (depthTest && !polyDepth)
     {
-        polyDepth += -poly->verts[i].z;
+        return;
     }
-    polyDepth >>= 8; // The depth buffer is 8 bits per pixel.
-
-    // Complete the vertex loop by connecting an extra vertex at the end to
-    // the beginning. This simplifies rendering.
-    poly->verts[poly->numVerts] = poly->verts[0];
 
-    int y = poly->verts[0].y;
+    // Get the vertices' screen coordinates as integers, wound counter-clockwise
+    // from the top, so that the edge setup below doesn't have to convert them.
+    // We also complete the vertex loop by connecting an extra vertex at the end
+    // to the beginning, which simplifies rendering.
+    int vertX[MAX_VERTEX_COUNT + 1];
+    int vertY[MAX_VERTEX_COUNT + 1];
+    const int polyHeight = sort_vertices_ccw(poly, vertX, vertY);
+    vertX[poly->numVerts] = vertX[0];
+    vertY[poly->numVerts] = vertY[0];
+
+    int y = vertY[0];
+    const int bottomY = (vertY[0] + polyHeight);
     unsigned leftVertIdx = 0;
     unsigned rightVertIdx = poly->numVerts;
 
-    /* Vertical interpolation deltas.*/
-    float deltaStartX, deltaEndX;
-    uint16_t textureVDelta = (poly->texture? (poly->texture->height / (float)polyHeight) : 0) * (1l << 8);
+    /* Vertical interpolation deltas (16.16 and 8.8 fixed point).*/
+    int32_t deltaStartX, deltaEndX;
+    const uint16_t textureVDelta = ((poly->texture && polyHeight)? (((int32_t)poly->texture->height << 8) / polyHeight) : 0);
 
-    /* Vertical interpolated values.*/
-    float startX, endX;
+    /* Vertical interpolated values (16.16 and 8.8 fixed point).*/
+    int32_t startX, endX;
     uint16_t textureV = 0;
 
-    init_lerp_deltas(&deltaStartX, 1, leftVertIdx, poly->verts);
-    init_lerp_deltas(&deltaEndX, -1, rightVertIdx, poly->verts);
+    // Polygons entirely outside the clip range have nothing to fill.
+    if ((bottomY <= clipTop) || (y >= clipBottom))
+    {
+        return;
+    }
 
-    init_lerp_values(&startX, leftVertIdx, poly->verts);
-    init_lerp_values(&endX, rightVertIdx, poly->verts);
-    
-    // Fill.
-    for (;;)
+    // Nor do polygons hidden behind what's already been drawn in the part of
+    // their bounding box that's inside the clip range.
+    if (depthTest)
     {
-        if (y >= GRAPHICS_MODE_HEIGHT)
+        int boxStartX = vertX[0];
+        int boxEndX = vertX[0];
+
+        for (unsigned i = 1; i < poly->numVerts; i++)
         {
-            break;
+            if (vertX[i] < boxStartX) boxStartX = vertX[i];
+            if (vertX[i] > boxEndX) boxEndX = vertX[i];
         }
-        
-        if (y == poly->verts[leftVertIdx + 1].y)
+
+        // Spans end at most at the rightmost vertex; the box's right edge is
+        // exclusive.
+        boxEndX++;
+
+        if (boxStartX < 0) boxStartX = 0;
+        if (boxEndX > (int)GRAPHICS_MODE_WIDTH) boxEndX = GRAPHICS_MODE_WIDTH;
+
+        if ((boxEndX > boxStartX) &&
+            is_area_occluded(boxStartX,
+                             ((y < clipTop)? clipTop : y),
+                             boxEndX,
+                             ((bottomY > clipBottom)? clipBottom : bottomY),
+                             polyDepth))
         {
-            leftVertIdx++;
-            init_lerp_deltas(&deltaStartX, 1, leftVertIdx, poly->verts);
-            init_lerp_values(&startX, leftVertIdx, poly->verts);
+            stats->numCoarseRejectedPolys++;
+            return;
         }
+    }
 
-        if (y == poly->verts[rightVertIdx - 1].y)
+    // If the polygon starts above the clip range, jump straight to the range's
+    // first scanline rather than stepping down to it: find the edges that
+    // stepping would be on at that scanline and advance their interpolants by
+    // the number of scanlines skipped. In fixed point, this lands on exactly
+    // the values that stepping would have.
+    if (y < clipTop)
+    {
+        // Stepping moves past at most one vertex per scanline (see below), so a
+        // vertex is only passed if it's below the scanline the previous one was
+        // passed on.
+        int nextSwitchY = y;
+
+        while ((vertY[leftVertIdx + 1] < clipTop) &&
+               (vertY[leftVertIdx + 1] >= nextSwitchY))
         {
-            rightVertIdx--;
-            init_lerp_deltas(&deltaEndX, -1, rightVertIdx, poly->verts);
-            init_lerp_values(&endX, rightVertIdx, poly->verts);
+            nextSwitchY = (vertY[++leftVertIdx] + 1);
         }
 
-        // When we reach the bottom of the polygon, we're done.
-        if (y >= (polyHeight + poly->verts[0].y))
+        nextSwitchY = y;
+
+        while ((vertY[rightVertIdx - 1] < clipTop) &&
+               (vertY[rightVertIdx - 1] >= nextSwitchY))
         {
-            break;
+            nextSwitchY = (vertY[--rightVertIdx] + 1);
         }
 
-        // Fill the current raster line.
-        if ((y >= 0) && (endX > startX))
-        {
-            const float lineWidth = (endX - startX + 1);
+        init_edge(&startX, &deltaStartX, leftVertIdx, (leftVertIdx + 1), vertX, vertY);
+        init_edge(&endX, &deltaEndX, rightVertIdx, (rightVertIdx - 1), vertX, vertY);
+
+        startX += ((clipTop - vertY[leftVertIdx]) * deltaStartX);
+        endX += ((clipTop - vertY[rightVertIdx]) * deltaEndX);
+        textureV = (uint16_t)((unsigned)(clipTop - y) * textureVDelta);
+
+        y = clipTop;
+    }
+    else
+    {
+        init_edge(&startX, &deltaStartX, leftVertIdx, (leftVertIdx + 1), vertX, vertY);
+        init_edge(&endX, &deltaEndX, rightVertIdx, (rightVertIdx - 1), vertX, vertY);
+    }
 
-            // Horizontal interpolated values.
-            uint16_t textureU = 0;
+    // The span kernel is chosen once for the whole polygon, based on its fill
+    // mode; the per-scanline work just updates the span's position.
+    const span_kernel_t fill_span = select_span_kernel(poly, depthTest);
+
+    // Spans of alpha-tested textures leave some of their pixels as they were,
+    // so can't raise the coarse depth.
+    const int updatesCoarseDepth = (depthTest && !(poly->texture && poly->texture->hasAlpha));
+    struct span_s span;
+    span.polyDepth = polyDepth;
+    span.color = poly->color;
+    span.texels = NULL;
+    span.deltaU = 0;
+
+    // Fill. When we reach the bottom of the polygon or of the clip range, we're
+    // done.
+    for (; (y < bottomY) && (y < clipBottom); y++)
+    {
+        // Move on to the next edge on either side when we reach its end vertex.
+        // Only one vertex per side is passed per scanline, as the floating-point
+        // walker did; so of several vertices sharing a scanline, the edge stops
+        // at the first of them.
+        if (y == vertY[leftVertIdx + 1])
+        {
+            leftVertIdx++;
+            init_edge(&startX, &deltaStartX, leftVertIdx, (leftVertIdx + 1), vertX, vertY);
+        }
 
-            // Horizontal interpolation deltas.
-            uint16_t deltaTextureU;
+        if (y == vertY[rightVertIdx - 1])
+        {
+            rightVertIdx--;
+            init_edge(&endX, &deltaEndX, rightVertIdx, (rightVertIdx - 1), vertX, vertY);
+        }
 
-            unsigned baseTexelIdx;
+        // Fill the current raster line, clipped to the screen.
+        if (endX > startX)
+        {
+            // The span covers the pixels from startX, rounded toward zero, up to
+            // but not including endX, as the floating-point walker's did.
+            int spanStartX = ((startX < 0)? -(int)(-startX >> FIXED_SHIFT) : (int)(startX >> FIXED_SHIFT));
+            int spanEndX = ((endX + (FIXED_ONE - 1)) >> FIXED_SHIFT);
 
             if (poly->texture)
             {
-                deltaTextureU = ((poly->texture->width / lineWidth) * (1l << 8));
-                baseTexelIdx = ((textureV >> 8) * poly->texture->width);
+                // Dividing the texture's width across the line's width plus one
+                // keeps the texture coordinate inside the texture's row for
+                // every pixel of the span.
+                const int32_t lineWidth = (endX - startX + FIXED_ONE);
+
+                span.deltaU = (uint16_t)(((uint32_t)poly->texture->width << 24) / (uint32_t)lineWidth);
+                span.texels = &poly->texture->pixels[(textureV >> 8) * poly->texture->width];
+            }
+
+            span.u = 0;
+
+            if (spanStartX < 0)
+            {
+                span.u += (uint16_t)((unsigned)-spanStartX * span.deltaU);
+                spanStartX = 0;
             }
-            else
+
+            if (spanEndX > (int)GRAPHICS_MODE_WIDTH)
             {
-                deltaTextureU = 0;
-                baseTexelIdx = 0;
+                spanEndX = GRAPHICS_MODE_WIDTH;
             }
 
-            for (int x = startX; x < endX; x++)
+            if ((spanEndX > spanStartX) &&
+                depthTest &&
+                is_span_occluded(y, spanStartX, spanEndX, polyDepth))
+            {
+                stats->numCoarseRejectedPixels += (spanEndX - spanStartX);
+            }
+            else if (spanEndX > spanStartX)
             {
-                if (x >= (int)GRAPHICS_MODE_WIDTH) break;
+                span.pixels = &VRAM_XY(spanStartX, y);
+                span.depth = (depthTest? &DEPTH_BUFFER_XY(spanStartX, y) : NULL);
+                span.width = (spanEndX - spanStartX);
 
-                if (x >= 0)
+                if (depthTest)
                 {
-                    unsigned color = 0;
+                    prepare_depth_row(y);
+                }
 
-                    if (poly->texture)
-                    {
-                        color = poly->texture->pixels[baseTexelIdx + (textureU >> 8)];
+                fill_span(&span);
+                mark_row_filled(y);
 
-                        // Alpha test.
-                        if (poly->texture->hasAlpha && !color)
-                        {
-                            goto increment_horizontal_deltas;
-                        }
-                    }
-                    else
-                    {
-                        color = poly->color;
-                    }
-
-                    // Depth test.
-                    if ((DEPTH_BUFFER_XY(x, y) >= polyDepth))
-                    {
-                        goto increment_horizontal_deltas;
-                    }
-
-                    VRAM_XY(x, y) = color;
-                    DEPTH_BUFFER_XY(x, y) = polyDepth;
+                if (updatesCoarseDepth)
+                {
+                    update_coarse_depth(y, spanStartX, spanEndX, polyDepth);
                 }
-
-                increment_horizontal_deltas:
-                textureU += deltaTextureU;
             }
         }
 
@@ -255,8 +424,6 @@ void fill_poly(struct polygon_s *const poly)
         startX += deltaStartX;
         endX += deltaEndX;
         textureV += textureVDelta;
-
-        y++;
     }
 
     return;
@@ -15,6 +15,7 @@ struct polygon_s kpolygon_create_polygon(const uint16_t numVerts)
     
     poly.numVerts = numVerts;
     poly.verts = calloc((poly.numVerts + 1), sizeof(struct vertex_s));
+    poly.vertIndices = NULL;
 
     return poly;
 }
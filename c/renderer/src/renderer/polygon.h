@@ -16,6 +16,11 @@ struct polygon_s
     uint16_t numVerts;
     struct vertex_s *verts;
 
+    // In a mesh with a shared vertex array (see struct mesh_s), the indices of
+    // the polygon's vertices in that array; the polygon's own vertex pointer is
+    // then unused until the mesh is drawn. NULL otherwise.
+    uint16_t *vertIndices;
+
     uint8_t color; // As a palette index.
     struct texture_s *texture;
 
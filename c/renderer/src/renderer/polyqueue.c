@@ -0,0 +1,194 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ * A queue of screen-space polygons whose filling is deferred to the end of the
+ * frame. In the painter's depth mode, all of a frame's polygons are collected
+ * here, sorted by their average depth with a radix sort, and then filled from
+ * back to front without using the depth buffer. When rendering with multiple
+ * threads, the polygons are likewise collected here and then filled in screen
+ * bands (see polybands.c), in the order in which they were queued.
+ * 
+ * NOTE: This file expects to be #included in renderer.c.
+ * 
+ */
+
+struct queued_poly_s
+{
+    // The polygon's vertices are stored in POLY_QUEUE_VERTS, starting at index
+    // firstVertIdx; the polygon's own vertex pointer is set when it's filled.
+    struct polygon_s poly;
+    uint32_t firstVertIdx;
+
+    // The polygon's average depth. Larger values are nearer the camera.
+    uint16_t sortKey;
+};
+
+static struct kelpo_generic_stack_s *POLY_QUEUE;
+static struct kelpo_generic_stack_s *POLY_QUEUE_VERTS;
+
+// Indices into POLY_QUEUE in the order in which the polygons are to be filled,
+// and a work area for sorting them.
+static uint32_t *POLY_QUEUE_ORDER;
+static uint32_t *POLY_QUEUE_SORT_SCRATCH;
+static uint32_t POLY_QUEUE_ORDER_CAPACITY;
+
+static void init_poly_queue(void)
+{
+    POLY_QUEUE = kelpo_generic_stack__create(1024, sizeof(struct queued_poly_s));
+    POLY_QUEUE_VERTS = kelpo_generic_stack__create(4096, sizeof(struct vertex_s));
+    POLY_QUEUE_ORDER = NULL;
+    POLY_QUEUE_SORT_SCRATCH = NULL;
+    POLY_QUEUE_ORDER_CAPACITY = 0;
+
+    return;
+}
+
+static void release_poly_queue(void)
+{
+    kelpo_generic_stack__free(POLY_QUEUE);
+    kelpo_generic_stack__free(POLY_QUEUE_VERTS);
+    free(POLY_QUEUE_ORDER);
+    free(POLY_QUEUE_SORT_SCRATCH);
+
+    return;
+}
+
+// Adds a copy of the given screen-space polygon, including its vertices, to the
+// queue.
+static void queue_poly(const struct polygon_s *const poly)
+{
+    struct queued_poly_s entry;
+    float depthSum = 0;
+
+    if (!poly->numVerts)
+    {
+        return;
+    }
+
+    entry.poly = *poly;
+    entry.poly.verts = NULL;
+    entry.firstVertIdx = POLY_QUEUE_VERTS->count;
+
+    for (unsigned i = 0; i < poly->numVerts; i++)
+    {
+        kelpo_generic_stack__push_copy(POLY_QUEUE_VERTS, &poly->verts[i]);
+        depthSum += -poly->verts[i].z;
+    }
+
+    {
+        const float averageDepth = (depthSum / poly->numVerts);
+
+        entry.sortKey = ((averageDepth < 0)? 0 : (averageDepth > 65535)? 65535 : averageDepth);
+    }
+
+    kelpo_generic_stack__push_copy(POLY_QUEUE, &entry);
+
+    return;
+}
+
+// Makes sure POLY_QUEUE_ORDER has room for the whole queue.
+static void reserve_poly_queue_order(void)
+{
+    if (POLY_QUEUE_ORDER_CAPACITY < POLY_QUEUE->count)
+    {
+        free(POLY_QUEUE_ORDER);
+        free(POLY_QUEUE_SORT_SCRATCH);
+
+        POLY_QUEUE_ORDER_CAPACITY = POLY_QUEUE->capacity;
+        POLY_QUEUE_ORDER = malloc(sizeof(*POLY_QUEUE_ORDER) * POLY_QUEUE_ORDER_CAPACITY);
+        POLY_QUEUE_SORT_SCRATCH = malloc(sizeof(*POLY_QUEUE_SORT_SCRATCH) * POLY_QUEUE_ORDER_CAPACITY);
+
+        assert((POLY_QUEUE_ORDER && POLY_QUEUE_SORT_SCRATCH) && "Failed to allocate memory for sorting polygons.");
+    }
+
+    return;
+}
+
+// Orders POLY_QUEUE_ORDER so that the queued polygons are filled from back to
+// front, i.e. by increasing sort key. The sort is an LSD radix sort over the
+// key's two bytes, and is stable, so polygons of equal depth keep the order in
+// which they were queued.
+static void sort_poly_queue_back_to_front(void)
+{
+    const uint32_t count = POLY_QUEUE->count;
+    const struct queued_poly_s *const queue = (struct queued_poly_s*)POLY_QUEUE->data;
+
+    // Sort by the low byte into the scratch buffer, then by the high byte back
+    // into the order buffer.
+    for (unsigned shift = 0; shift < 16; shift += 8)
+    {
+        uint32_t *const src = ((shift == 0)? POLY_QUEUE_ORDER : POLY_QUEUE_SORT_SCRATCH);
+        uint32_t *const dst = ((shift == 0)? POLY_QUEUE_SORT_SCRATCH : POLY_QUEUE_ORDER);
+        uint32_t offsets[256] = {0};
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            offsets[(queue[src[i]].sortKey >> shift) & 0xff]++;
+        }
+
+        for (uint32_t i = 0, sum = 0; i < 256; i++)
+        {
+            const uint32_t bucketSize = offsets[i];
+            offsets[i] = sum;
+            sum += bucketSize;
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            dst[offsets[(queue[src[i]].sortKey >> shift) & 0xff]++] = src[i];
+        }
+    }
+
+    return;
+}
+
+// Readies the queued polygons for filling: points each at its vertices and
+// arranges POLY_QUEUE_ORDER into the order in which they're to be filled -
+// back to front if backToFront is true, or else the order they were queued in.
+// Also counts the polygons in the render statistics.
+static void order_poly_queue(const int backToFront)
+{
+    struct vertex_s *const verts = (struct vertex_s*)POLY_QUEUE_VERTS->data;
+    struct queued_poly_s *const queue = (struct queued_poly_s*)POLY_QUEUE->data;
+
+    reserve_poly_queue_order();
+
+    for (uint32_t i = 0; i < POLY_QUEUE->count; i++)
+    {
+        queue[i].poly.verts = &verts[queue[i].firstVertIdx];
+        POLY_QUEUE_ORDER[i] = i;
+
+        count_poly_fill(&queue[i].poly);
+    }
+
+    if (backToFront)
+    {
+        sort_poly_queue_back_to_front();
+    }
+
+    return;
+}
+
+// Fills the queued polygons on the calling thread, in the order arranged by
+// order_poly_queue().
+static void fill_poly_queue(const int depthTest)
+{
+    const struct queued_poly_s *const queue = (struct queued_poly_s*)POLY_QUEUE->data;
+
+    for (uint32_t i = 0; i < POLY_QUEUE->count; i++)
+    {
+        fill_poly(&queue[POLY_QUEUE_ORDER[i]].poly, depthTest, 0, GRAPHICS_MODE_HEIGHT, &RENDER_STATS);
+    }
+
+    return;
+}
+
+static void clear_poly_queue(void)
+{
+    kelpo_generic_stack__clear(POLY_QUEUE);
+    kelpo_generic_stack__clear(POLY_QUEUE_VERTS);
+
+    return;
+}
@@ -11,30 +11,192 @@
 
 #include <math.h>
 
+// The perspective divisor at a given depth is (CAMERA_POS.z + z / 575). Since
+// the camera's depth rarely changes, and the ground's and props' vertices sit
+// at whole-number depths - each row of ground tiles sharing one - we keep
+// a table of the divisor's reciprocal at each whole depth from 0 down to
+// -(DEPTH_RECIPROCAL_TABLE_SIZE - 1), and project by multiplying with it
+// rather than dividing. There's a floating-point and a 16.16 fixed-point
+// version of each reciprocal.
+#define DEPTH_RECIPROCAL_TABLE_SIZE 4096
+#define PROJECTION_FIXED_SHIFT 16
+#define PROJECTION_FIXED_ONE (1l << PROJECTION_FIXED_SHIFT)
+static float DEPTH_RECIPROCALS[DEPTH_RECIPROCAL_TABLE_SIZE];
+static int32_t DEPTH_RECIPROCALS_FIXED[DEPTH_RECIPROCAL_TABLE_SIZE];
+
+// How many of the table's entries, from depth 0 down, are valid for the
+// floating-point and fixed-point projections. The table ends where the
+// divisor drops to 0 (behind the camera) or, for fixed point, to 1, below
+// which the reciprocal would no longer fit 16.16 products in 32 bits.
+static unsigned NUM_DEPTH_RECIPROCALS = 0;
+static unsigned NUM_DEPTH_RECIPROCALS_FIXED = 0;
+
+// The camera depth for which the table was last built.
+static float DEPTH_RECIPROCALS_CAMERA_Z = 0;
+
+// Rebuilds the reciprocal table if the camera's depth has changed since it was
+// last built.
+static void update_depth_reciprocals(void)
+{
+    if ((NUM_DEPTH_RECIPROCALS > 0) &&
+        (DEPTH_RECIPROCALS_CAMERA_Z == CAMERA_POS.z))
+    {
+        return;
+    }
+
+    NUM_DEPTH_RECIPROCALS = NUM_DEPTH_RECIPROCALS_FIXED = 0;
+
+    for (unsigned i = 0; i < DEPTH_RECIPROCAL_TABLE_SIZE; i++)
+    {
+        const double divisor = (CAMERA_POS.z + -(double)i / 575.0);
+
+        if (divisor <= 0)
+        {
+            break;
+        }
+
+        DEPTH_RECIPROCALS[i] = (1.0 / divisor);
+        NUM_DEPTH_RECIPROCALS++;
+
+        if (divisor >= 1)
+        {
+            DEPTH_RECIPROCALS_FIXED[i] = (PROJECTION_FIXED_ONE / divisor);
+            NUM_DEPTH_RECIPROCALS_FIXED++;
+        }
+    }
+
+    DEPTH_RECIPROCALS_CAMERA_Z = CAMERA_POS.z;
+
+    return;
+}
+
 // Perspective division to a vanishing point at the top center of the screen
-// (e.g. to x=160, y=0 in VGA mode 13h).
-void krender_transform_poly(struct polygon_s *const poly)
+// (e.g. to x=160, y=0 in VGA mode 13h). Depending on the projection mode, the
+// division may be done by multiplying with a reciprocal from the table above,
+// in which case update_depth_reciprocals() must have been called since the
+// camera last moved in depth. Vertices not at a whole depth covered by the
+// table are always divided.
+static void project_vertex(struct vertex_s *const vert)
 {
     const float screenWidthHalf = (GRAPHICS_MODE_WIDTH / 2);
 
-    for (unsigned i = 0; i < poly->numVerts; i++)
+    if ((PROJECTION_MODE != KRENDER_PROJECTION_DIVIDE) &&
+        (vert->z <= 0) &&
+        (vert->z > -DEPTH_RECIPROCAL_TABLE_SIZE))
     {
-        poly->verts[i].x = floor(screenWidthHalf + ((CAMERA_POS.x + poly->verts[i].x - screenWidthHalf) / (CAMERA_POS.z + poly->verts[i].z / 575.0)));
-        poly->verts[i].y = floor((CAMERA_POS.y + poly->verts[i].y) / (CAMERA_POS.z + poly->verts[i].z / 575.0));
+        const unsigned depthIdx = -(int)vert->z;
+        const float a = (CAMERA_POS.x + vert->x - screenWidthHalf);
+        const float b = (CAMERA_POS.y + vert->y);
+
+        if (depthIdx == -vert->z)
+        {
+            if ((PROJECTION_MODE == KRENDER_PROJECTION_RECIPROCAL_FIXED) &&
+                (depthIdx < NUM_DEPTH_RECIPROCALS_FIXED) &&
+                (fabs(a) < 32768) && (fabs(b) < 32768) &&
+                ((int32_t)a == a) && ((int32_t)b == b))
+            {
+                const int32_t reciprocal = DEPTH_RECIPROCALS_FIXED[depthIdx];
+
+                vert->x = (screenWidthHalf + (((int32_t)a * reciprocal) >> PROJECTION_FIXED_SHIFT));
+                vert->y = (((int32_t)b * reciprocal) >> PROJECTION_FIXED_SHIFT);
+
+                return;
+            }
+            else if (depthIdx < NUM_DEPTH_RECIPROCALS)
+            {
+                const float reciprocal = DEPTH_RECIPROCALS[depthIdx];
+
+                vert->x = floor(screenWidthHalf + (a * reciprocal));
+                vert->y = floor(b * reciprocal);
+
+                return;
+            }
+        }
+    }
+
+    vert->x = floor(screenWidthHalf + ((CAMERA_POS.x + vert->x - screenWidthHalf) / (CAMERA_POS.z + vert->z / 575.0)));
+    vert->y = floor((CAMERA_POS.y + vert->y) / (CAMERA_POS.z + vert->z / 575.0));
+
+    return;
+}
+
+// Returns true if the given screen-space polygon's bounding box overlaps the
+// screen. This also keeps polygons that straddle the screen with all of their
+// vertices outside it. The vertices are whole pixels once projected, and the
+// filler covers the pixels from a polygon's minimum X and Y up to but not
+// including its maximum X and Y, so a box ending at the screen's edge has
+// nothing to fill.
+static int is_poly_on_screen(const struct polygon_s *const poly)
+{
+    float minX = poly->verts[0].x, maxX = poly->verts[0].x;
+    float minY = poly->verts[0].y, maxY = poly->verts[0].y;
+
+    for (unsigned i = 1; i < poly->numVerts; i++)
+    {
+        if (poly->verts[i].x < minX) minX = poly->verts[i].x;
+        if (poly->verts[i].x > maxX) maxX = poly->verts[i].x;
+        if (poly->verts[i].y < minY) minY = poly->verts[i].y;
+        if (poly->verts[i].y > maxY) maxY = poly->verts[i].y;
+    }
+
+    return ((maxX > 0) && (minX < GRAPHICS_MODE_WIDTH) &&
+            (maxY > 0) && (minY < GRAPHICS_MODE_HEIGHT));
+}
+
+void krender_transform_poly(struct polygon_s *const poly)
+{
+    if (PROJECTION_MODE != KRENDER_PROJECTION_DIVIDE)
+    {
+        update_depth_reciprocals();
     }
 
-    // Find whether at least one of the polygon's transformed vertices is inside
-    // the view frustum.
-    poly->visible = 1;
     for (unsigned i = 0; i < poly->numVerts; i++)
     {
-        if (((poly->verts[i].x >= 0) && (poly->verts[i].x < GRAPHICS_MODE_WIDTH)) &&
-            ((poly->verts[i].y >= 0) && (poly->verts[i].y < GRAPHICS_MODE_HEIGHT)))
+        project_vertex(&poly->verts[i]);
+    }
+
+    poly->visible = is_poly_on_screen(poly);
+
+    return;
+}
+
+// Returns true if the given mesh's bounding box, placed at the mesh's position,
+// projects entirely outside the screen, in which case none of the mesh's
+// polygons can be visible. Meshes without a bounding box, and those whose box
+// reaches behind the camera (where the projection flips), are never culled.
+static int is_mesh_off_screen(const struct mesh_s *const mesh)
+{
+    float minX = 0, maxX = 0, minY = 0, maxY = 0;
+
+    if (!mesh->hasBounds)
+    {
+        return 0;
+    }
+
+    // While the divisor stays positive, the projection (by division or by
+    // reciprocal) is monotonic in each of a vertex's coordinates, so the box's
+    // corners bound all of its contents on screen.
+    for (unsigned i = 0; i < 8; i++)
+    {
+        struct vertex_s corner;
+
+        corner.x = (mesh->x + ((i & 1)? mesh->maxX : mesh->minX));
+        corner.y = (mesh->y + ((i & 2)? mesh->maxY : mesh->minY));
+        corner.z = (mesh->z + ((i & 4)? mesh->maxZ : mesh->minZ));
+
+        if ((CAMERA_POS.z + corner.z / 575.0) <= 0)
         {
-            poly->visible = 1;
-            break;
+            return 0;
         }
+
+        project_vertex(&corner);
+
+        if (!i || (corner.x < minX)) minX = corner.x;
+        if (!i || (corner.x > maxX)) maxX = corner.x;
+        if (!i || (corner.y < minY)) minY = corner.y;
+        if (!i || (corner.y > maxY)) maxY = corner.y;
     }
-    
-    return;
+
+    return ((maxX <= 0) || (minX >= GRAPHICS_MODE_WIDTH) ||
+            (maxY <= 0) || (minY >= GRAPHICS_MODE_HEIGHT));
 }
@@ -6,12 +6,15 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
 #include "common/file.h"
+#include "common/genstack.h"
 #include "assets/mesh.h"
 #include "assets/ground.h"
+#include "assets/assetcache.h"
 #include "renderer/renderer.h"
 #include "renderer/polygon.h"
 
@@ -23,17 +26,29 @@
         #include <bios.h>
         #include <dos.h>
     #endif
-#else // We'll render into an SDL surface if not on DOS.
-    #include <SDL2/SDL.h>
-
-    static SDL_Window *sdlWindow;
-    static SDL_Renderer *sdlRenderer;
-    static SDL_Texture *sdlTexture;
-
+#else
     // Color indices in the render buffer point to RGB values in this palette.
     static uint8_t PALETTE[256][3];
+
+    // In headless builds, finished frames are only handed to the frame sink;
+    // otherwise, we'll render into an SDL surface if not on DOS.
+    #if !RENDER_HEADLESS
+        #include <SDL2/SDL.h>
+
+        static SDL_Window *sdlWindow;
+        static SDL_Renderer *sdlRenderer;
+        static SDL_Texture *sdlTexture;
+    #endif
 #endif
 
+// If set, krender_flip_surface() will pass each finished frame to this function.
+static krender_frame_sink_t FRAME_SINK = NULL;
+static void *FRAME_SINK_DATA = NULL;
+
+// Rally-Sport's palettes, in RALLYE.EXE.
+#define NUM_PALETTES 5
+#define PALETTES_BYTE_OFFS 131798l
+
 static const unsigned GRAPHICS_MODE_WIDTH = 320;
 static const unsigned GRAPHICS_MODE_HEIGHT = 200;
 
@@ -45,29 +60,41 @@ static uint8_t *RENDER_BUFFER;
 static uint8_t *DEPTH_BUFFER;
 #define DEPTH_BUFFER_XY(x, y) DEPTH_BUFFER[(x) + (y) * GRAPHICS_MODE_WIDTH]
 
-#define LERP(a, b, weight) ((a) + ((weight) * ((b) - (a))))
-
 static unsigned CURRENT_VIDEO_MODE = VIDEO_MODE_TEXT;
 
 static struct vertex_s CAMERA_POS = {0, 800, 10};
 
+static struct krender_stats_s RENDER_STATS;
+
+// How polygons are ordered in depth (KRENDER_DEPTH_MODE_x).
+static unsigned DEPTH_MODE = KRENDER_DEPTH_MODE_BUFFER;
+
+// How vertices are projected onto the screen (KRENDER_PROJECTION_x).
+static unsigned PROJECTION_MODE = KRENDER_PROJECTION_DIVIDE;
+
 #include "polytrnf.c"
+#include "dirtyrows.c"
+#include "coarsedepth.c"
+#include "depthepoch.c"
+#include "spanfill.c"
+#include "spansimd.c"
 #include "polyfill.c"
+#include "polyqueue.c"
+#include "polybands.c"
+#include "palconv.c"
 
+#if MSDOS
 static int current_video_mode(void)
 {
-    #if MSDOS
-        union REGS regs;
-        regs.h.ah = 0xf;
-        regs.h.al = 0;
+    union REGS regs;
+    regs.h.ah = 0xf;
+    regs.h.al = 0;
 
-        int86(0x10, &regs, &regs);
+    int86(0x10, &regs, &regs);
 
-        return regs.h.al;
-    #else
-        return CURRENT_VIDEO_MODE;
-    #endif
+    return regs.h.al;
 }
+#endif
 
 float krender_camera_x(void)
 {
@@ -79,11 +106,45 @@ float krender_camera_z(void)
     return CAMERA_POS.z;
 }
 
+const struct krender_stats_s* krender_stats(void)
+{
+    return &RENDER_STATS;
+}
+
+void krender_reset_stats(void)
+{
+    memset(&RENDER_STATS, 0, sizeof(RENDER_STATS));
+
+    return;
+}
+
+unsigned krender_use_simd(const int allowSimd)
+{
+    init_span_kernels(allowSimd);
+
+    #if !MSDOS && !RENDER_HEADLESS
+        USE_REFERENCE_CONVERSION = !allowSimd;
+    #endif
+
+    return SPAN_KERNEL_ISA;
+}
+
 void krender_initialize(void)
 {
     RENDER_BUFFER = malloc(sizeof(*RENDER_BUFFER) * GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT);
     DEPTH_BUFFER = malloc(sizeof(*DEPTH_BUFFER) * GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT);
 
+    init_span_kernels(1);
+    init_poly_queue();
+    init_poly_bands();
+    init_dirty_rows();
+    init_coarse_depth();
+    init_depth_epochs();
+
+    #if !MSDOS && !RENDER_HEADLESS
+        update_packed_palette();
+    #endif
+
     krender_enter_grapics_mode();
     krender_clear_surface();
 
@@ -94,41 +155,192 @@ void krender_release(void)
 {
     free(RENDER_BUFFER);
     free(DEPTH_BUFFER);
+    release_poly_bands();
+    release_poly_queue();
+    release_dirty_rows();
+    release_depth_epochs();
+    release_coarse_depth();
 
     krender_enter_text_mode();
 
     return;
 }
 
+void krender_set_depth_mode(const unsigned depthMode)
+{
+    assert(((depthMode == KRENDER_DEPTH_MODE_BUFFER) ||
+            (depthMode == KRENDER_DEPTH_MODE_PAINTER)) &&
+           "Unknown depth mode.");
+
+    // Don't leave polygons queued under the old mode unfilled.
+    krender_flush();
+
+    // Polygons filled in the painter's mode don't mark the depth buffer, so
+    // a deferred clear can't be resolved after them.
+    finish_deferred_clear();
+
+    DEPTH_MODE = depthMode;
+
+    return;
+}
+
+void krender_set_clear_mode(const unsigned clearMode)
+{
+    assert(((clearMode == KRENDER_CLEAR_MODE_FULL) ||
+            (clearMode == KRENDER_CLEAR_MODE_EPOCH_DEPTH) ||
+            (clearMode == KRENDER_CLEAR_MODE_EPOCH)) &&
+           "Unknown clear mode.");
+
+    CLEAR_MODE = clearMode;
+
+    return;
+}
+
+void krender_set_projection(const unsigned projection)
+{
+    assert(((projection == KRENDER_PROJECTION_DIVIDE) ||
+            (projection == KRENDER_PROJECTION_RECIPROCAL_FLOAT) ||
+            (projection == KRENDER_PROJECTION_RECIPROCAL_FIXED)) &&
+           "Unknown projection mode.");
+
+    PROJECTION_MODE = projection;
+
+    return;
+}
+
+unsigned krender_set_thread_count(const unsigned numThreads)
+{
+    // The queued polygons may have been collected for the current workers.
+    krender_flush();
+
+    stop_band_workers();
+
+    return start_band_workers(numThreads);
+}
+
+void krender_flush(void)
+{
+    const int depthTest = (DEPTH_MODE == KRENDER_DEPTH_MODE_BUFFER);
+
+    if (!POLY_QUEUE->count)
+    {
+        return;
+    }
+
+    order_poly_queue(!depthTest);
+
+    if (NUM_RENDER_THREADS > 1)
+    {
+        fill_poly_queue_in_bands(depthTest);
+    }
+    else
+    {
+        fill_poly_queue(depthTest);
+    }
+
+    clear_poly_queue();
+
+    return;
+}
+
 void krender_flip_surface(void)
 {
+    krender_flush();
+    finish_deferred_clear();
+
+    // With nothing to present the frame to, there's no point in finding out
+    // what changed in it.
+    #if RENDER_HEADLESS
+        if (!FRAME_SINK)
+        {
+            return;
+        }
+    #endif
+
+    RENDER_STATS.numPresentedRows += update_dirty_rows();
+
     #if MSDOS
         // Wait for vsync.
         while ((inp(0x03da)  & 0x08)) _asm{nop};
         while (!(inp(0x03da) & 0x08)) _asm{nop};
 
-        // Copy into VGA mode 13h video memory.
-        memcpy((uint8_t*)0xA0000000L, RENDER_BUFFER, (sizeof(*RENDER_BUFFER) * GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT));
-    #else
-        static uint8_t *scratch = 0;
-        if (!scratch)
+        unsigned y, numRows;
+
+        // Copy the changed scanlines into VGA mode 13h video memory.
+        for (y = 0; next_dirty_rows(&y, &numRows); y += numRows)
         {
-            scratch = malloc(GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT * 4);
+            memcpy(((uint8_t*)0xA0000000L + (y * GRAPHICS_MODE_WIDTH)),
+                   &VRAM_XY(0, y),
+                   (sizeof(*RENDER_BUFFER) * GRAPHICS_MODE_WIDTH * numRows));
         }
+    #elif RENDER_HEADLESS
+        // Nothing to present to; the frame sink (if any) receives the frame
+        // below.
+    #else
+        unsigned y, numRows;
 
-        for (unsigned i = 0; i < (GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT); i++)
+        // Convert the changed scanlines straight into the texture's memory.
+        for (y = 0; next_dirty_rows(&y, &numRows); y += numRows)
         {
-            scratch[(i * 4) + 0] = PALETTE[RENDER_BUFFER[i]][0];
-            scratch[(i * 4) + 1] = PALETTE[RENDER_BUFFER[i]][1];
-            scratch[(i * 4) + 2] = PALETTE[RENDER_BUFFER[i]][2];
-            scratch[(i * 4) + 3] = 255;
+            SDL_Rect rect;
+            void *texturePixels;
+            int texturePitch;
+
+            rect.x = 0;
+            rect.y = y;
+            rect.w = GRAPHICS_MODE_WIDTH;
+            rect.h = numRows;
+
+            if (SDL_LockTexture(sdlTexture, &rect, &texturePixels, &texturePitch) == 0)
+            {
+                convert_render_rows(texturePixels, texturePitch, y, numRows);
+                SDL_UnlockTexture(sdlTexture);
+            }
         }
 
-        SDL_UpdateTexture(sdlTexture, NULL, scratch, (GRAPHICS_MODE_WIDTH * 4));
         SDL_RenderCopy(sdlRenderer, sdlTexture, NULL, NULL);
         SDL_RenderPresent(sdlRenderer);
     #endif
 
+    if (FRAME_SINK)
+    {
+        #if MSDOS
+            FRAME_SINK(RENDER_BUFFER, GRAPHICS_MODE_WIDTH, GRAPHICS_MODE_HEIGHT, NULL, FRAME_SINK_DATA);
+        #else
+            FRAME_SINK(RENDER_BUFFER, GRAPHICS_MODE_WIDTH, GRAPHICS_MODE_HEIGHT, (const uint8_t(*)[3])PALETTE, FRAME_SINK_DATA);
+        #endif
+    }
+
+    return;
+}
+
+void krender_set_frame_sink(krender_frame_sink_t sink, void *const userData)
+{
+    FRAME_SINK = sink;
+    FRAME_SINK_DATA = userData;
+
+    // The new sink hasn't seen the previous frames.
+    invalidate_presented_rows();
+
+    return;
+}
+
+int krender_row_changed(const unsigned y)
+{
+    assert((y < GRAPHICS_MODE_HEIGHT) && "Scanline index out of bounds.");
+
+    return ((ROW_FLAGS[y] & ROW_DIRTY) != 0);
+}
+
+void krender_bake_palettes(void)
+{
+    struct kfile_mapping_s palettes = kfile_map_file("RALLYE.EXE", PALETTES_BYTE_OFFS, (NUM_PALETTES * 32 * 3));
+
+    kassetcache_begin_section(KASSETCACHE_PALETTES);
+    kassetcache_write(palettes.data, palettes.size);
+
+    kfile_unmap_file(&palettes);
+
     return;
 }
 
@@ -136,21 +348,26 @@ void krender_use_palette(const unsigned paletteIdx)
 {
     assert((CURRENT_VIDEO_MODE == VIDEO_MODE_GRAPHICS) && "Can only set the palette while in graphics mode.");
 
-    assert((paletteIdx < 5) && "Palette index out of bounds.");
-
-    const file_handle_t rallyeHandle = kfile_open_file("RALLYE.EXE", "rb");
+    assert((paletteIdx < NUM_PALETTES) && "Palette index out of bounds.");
 
-    // Seek to the start of the palette block.
+    // Map the palette block, unless the asset cache has it.
     // (There are 32 colors per palette, and 3 color channels (rgb) per color.)
-    const uint32_t paletteByteOffs = (131798 + (paletteIdx * 32 * 3));
-    kfile_seek(paletteByteOffs, rallyeHandle);
+    const uint8_t *const cachedPalettes = kassetcache_section(KASSETCACHE_PALETTES, NULL);
+    struct kfile_mapping_s palette;
+
+    if (cachedPalettes)
+    {
+        palette.data = &cachedPalettes[paletteIdx * 32 * 3];
+    }
+    else
+    {
+        palette = kfile_map_file("RALLYE.EXE", (PALETTES_BYTE_OFFS + (paletteIdx * 32 * 3)), (32 * 3));
+    }
 
     // Read in all 32 primary colors of the palette.
     for (unsigned i = 0; i < 32; i++)
     {
-        uint8_t color[3];
-
-        kfile_read_byte_array(color, 3, rallyeHandle);
+        const uint8_t *const color = &palette.data[i * 3];
 
         #ifdef MSDOS
             outp(0x03c8, i);
@@ -164,7 +381,15 @@ void krender_use_palette(const unsigned paletteIdx)
         #endif
     }
 
-    kfile_close_file(rallyeHandle);
+    #if !MSDOS && !RENDER_HEADLESS
+        update_packed_palette();
+        invalidate_presented_rows();
+    #endif
+
+    if (!cachedPalettes)
+    {
+        kfile_unmap_file(&palette);
+    }
 
     return;
 }
@@ -175,8 +400,30 @@ void krender_clear_surface(void)
     {
         case VIDEO_MODE_GRAPHICS:
         {
-            memset(RENDER_BUFFER, 0, (sizeof(*RENDER_BUFFER) * GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT));
-            memset(DEPTH_BUFFER, 0, (sizeof(*DEPTH_BUFFER) * GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT));
+            // The painter's mode doesn't use the depth buffer, and so can't
+            // use its epochs either.
+            const int useEpochs = ((DEPTH_MODE == KRENDER_DEPTH_MODE_BUFFER) &&
+                                   (CLEAR_MODE != KRENDER_CLEAR_MODE_FULL));
+
+            COLOR_CLEAR_PENDING = (useEpochs && (CLEAR_MODE == KRENDER_CLEAR_MODE_EPOCH));
+
+            if (!COLOR_CLEAR_PENDING)
+            {
+                memset(RENDER_BUFFER, 0, (sizeof(*RENDER_BUFFER) * GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT));
+            }
+
+            mark_rows_cleared();
+
+            if (useEpochs)
+            {
+                advance_depth_epoch();
+            }
+            else if (DEPTH_MODE == KRENDER_DEPTH_MODE_BUFFER)
+            {
+                memset(DEPTH_BUFFER, 0, (sizeof(*DEPTH_BUFFER) * GRAPHICS_MODE_WIDTH * GRAPHICS_MODE_HEIGHT));
+                mark_depth_rows_current();
+                clear_coarse_depth();
+            }
 
             break;
         }
@@ -192,42 +439,130 @@ void krender_clear_surface(void)
     return;
 }
 
+// Readies the given polygon for filling: fills it in right away, or queues it
+// to be filled at the next flush.
+static void submit_poly(const struct polygon_s *const poly)
+{
+    // The painter's mode and the multithreaded fill need the whole frame's
+    // polygons before they can start filling.
+    if ((DEPTH_MODE == KRENDER_DEPTH_MODE_PAINTER) ||
+        (NUM_RENDER_THREADS > 1))
+    {
+        queue_poly(poly);
+    }
+    else
+    {
+        count_poly_fill(poly);
+        fill_poly(poly, 1, 0, GRAPHICS_MODE_HEIGHT, &RENDER_STATS);
+    }
+
+    return;
+}
+
+// Returns a buffer with room for at least the given number of vertices. The
+// buffer is reused between calls, so its previous contents are lost.
+static struct vertex_s* mesh_vertex_scratch(const unsigned numVerts)
+{
+    static struct vertex_s *scratch = NULL;
+    static unsigned capacity = 0;
+
+    if (capacity < numVerts)
+    {
+        /// TODO: Free this allocation on program exit.
+        free(scratch);
+        scratch = malloc(sizeof(*scratch) * numVerts);
+        capacity = numVerts;
+
+        assert(scratch && "Failed to allocate memory for transforming vertices.");
+    }
+
+    return scratch;
+}
+
 void krender_draw_mesh(const struct mesh_s *const mesh, const int doTransform)
 {
     // A scratch buffer to copy polygons' transformed vertices into.
-    static struct vertex_s *vertexScratch = NULL;
-    if (!vertexScratch)
+    struct vertex_s vertexScratch[MAX_VERTEX_COUNT];
+
+    // If the mesh's polygons share its vertices, the vertices are moved to the
+    // mesh's world position and transformed once up front, then gathered for
+    // each polygon as it's drawn.
+    struct vertex_s *meshVerts = NULL;
+
+    if (doTransform && (PROJECTION_MODE != KRENDER_PROJECTION_DIVIDE))
     {
-        /// TODO: Free this allocation on program exit.
-        vertexScratch = malloc(sizeof(struct vertex_s) * 10);
+        update_depth_reciprocals();
+    }
+
+    if (doTransform && is_mesh_off_screen(mesh))
+    {
+        RENDER_STATS.numCulledMeshes++;
+        return;
     }
 
-    /// TODO: Verify that the vertex scratch buffer has enough allocated
-    /// memory to hold the mesh's largest polygon's vertices.
+    if (mesh->verts)
+    {
+        meshVerts = mesh_vertex_scratch(mesh->numVerts);
+
+        for (unsigned v = 0; v < mesh->numVerts; v++)
+        {
+            meshVerts[v] = mesh->verts[v];
+            meshVerts[v].x += mesh->x;
+            meshVerts[v].y += mesh->y;
+            meshVerts[v].z += mesh->z;
+
+            if (doTransform)
+            {
+                project_vertex(&meshVerts[v]);
+            }
+        }
+    }
 
     for (unsigned i = 0; i < mesh->numPolys; i++)
     {
         struct polygon_s poly = mesh->polys[i];
         poly.verts = vertexScratch;
-        memcpy(poly.verts, mesh->polys[i].verts, sizeof(struct vertex_s) * mesh->polys[i].numVerts);
 
-        // Apply the mesh's world position to the copies of its vertices.
-        for (unsigned v = 0; v < poly.numVerts; v++)
+        assert((poly.numVerts <= MAX_VERTEX_COUNT) && "Too many vertices in a polygon.");
+
+        if (meshVerts)
         {
-            poly.verts[v].x += mesh->x;
-            poly.verts[v].y += mesh->y;
-            poly.verts[v].z += mesh->z;
+            for (unsigned v = 0; v < poly.numVerts; v++)
+            {
+                poly.verts[v] = meshVerts[poly.vertIndices[v]];
+            }
+
+            if (doTransform)
+            {
+                poly.visible = is_poly_on_screen(&poly);
+            }
         }
-
-        if (doTransform)
+        else
         {
-            krender_transform_poly(&poly);
+            memcpy(poly.verts, mesh->polys[i].verts, sizeof(struct vertex_s) * poly.numVerts);
+
+            // Apply the mesh's world position to the copies of its vertices.
+            for (unsigned v = 0; v < poly.numVerts; v++)
+            {
+                poly.verts[v].x += mesh->x;
+                poly.verts[v].y += mesh->y;
+                poly.verts[v].z += mesh->z;
+            }
+
+            if (doTransform)
+            {
+                krender_transform_poly(&poly);
+            }
         }
 
         if (poly.visible)
         {
-            fill_poly(&poly);
-        }        
+            submit_poly(&poly);
+        }
+        else
+        {
+            RENDER_STATS.numCulledPolys++;
+        }
     }
     
     return;
@@ -248,6 +583,8 @@ int krender_enter_grapics_mode(void)
         int86(0x10, &regs, &regs);
 
         CURRENT_VIDEO_MODE = current_video_mode();
+    #elif RENDER_HEADLESS
+        CURRENT_VIDEO_MODE = VIDEO_MODE_GRAPHICS;
     #else
         sdlWindow = SDL_CreateWindow("Rally-Sport render test", 0, 0, 1280, 800, SDL_WINDOW_OPENGL);
         sdlRenderer = SDL_CreateRenderer(sdlWindow, -1, (SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC));
@@ -260,6 +597,9 @@ int krender_enter_grapics_mode(void)
         CURRENT_VIDEO_MODE = VIDEO_MODE_GRAPHICS;
     #endif
 
+    // What was last presented is gone with the mode change.
+    invalidate_presented_rows();
+
     return (CURRENT_VIDEO_MODE == VIDEO_MODE_GRAPHICS);
 }
 
@@ -273,6 +613,8 @@ int krender_enter_text_mode(void)
         int86(0x10, &regs, &regs);
 
         CURRENT_VIDEO_MODE = current_video_mode();
+    #elif RENDER_HEADLESS
+        CURRENT_VIDEO_MODE = VIDEO_MODE_TEXT;
     #else 
         SDL_DestroyWindow(sdlWindow);
         SDL_DestroyRenderer(sdlRenderer);
@@ -8,36 +8,160 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
+#include <stdint.h>
+
 struct polygon_s;
 struct mesh_s;
 
+// Counters of the renderer's work, accumulated until krender_reset_stats() is
+// called. Intended for verifying and profiling the render paths.
+struct krender_stats_s
+{
+    // How many polygons were filled with each span kernel: solid color,
+    // opaque texture, and alpha-tested texture.
+    uint32_t numFlatPolys;
+    uint32_t numTexturedPolys;
+    uint32_t numAlphaTexturedPolys;
+
+    // How many polygons were skipped for lying entirely off-screen once
+    // transformed, and how many meshes were skipped whole for their bounding
+    // boxes lying off-screen (their polygons aren't included in the former).
+    uint32_t numCulledPolys;
+    uint32_t numCulledMeshes;
+
+    // How many polygons were skipped whole, and how many pixels were skipped
+    // a span at a time, for the coarse depth buffer showing them to be hidden
+    // behind what had already been drawn. When filling with multiple threads,
+    // a polygon is counted once for each screen band it was skipped in.
+    uint32_t numCoarseRejectedPolys;
+    uint32_t numCoarseRejectedPixels;
+
+    // How many scanlines krender_flip_surface() found to have changed since
+    // the previous frame, and so presented.
+    uint32_t numPresentedRows;
+};
+
 enum
 {
     VIDEO_MODE_GRAPHICS = 0x13,
     VIDEO_MODE_TEXT = 0x3
 };
 
+// Ways of resolving which polygons are in front of which.
+enum
+{
+    // Polygons are filled as they're drawn, each pixel tested against and
+    // written into a depth buffer.
+    KRENDER_DEPTH_MODE_BUFFER,
+
+    // Polygons are collected over the frame and filled back to front by their
+    // average depth when the frame is flushed, without a depth buffer. This is
+    // how Rally-Sport itself draws.
+    KRENDER_DEPTH_MODE_PAINTER
+};
+
+// Ways of clearing the render and depth buffers in krender_clear_surface().
+enum
+{
+    // Both buffers are cleared in full.
+    KRENDER_CLEAR_MODE_FULL,
+
+    // The render buffer is cleared in full. The depth buffer is cleared piece
+    // by piece as polygons are filled into it, and only where they are.
+    KRENDER_CLEAR_MODE_EPOCH_DEPTH,
+
+    // As KRENDER_CLEAR_MODE_EPOCH_DEPTH, but the render buffer's clear is also
+    // deferred until the frame is flipped, when only the pixels that weren't
+    // drawn into are cleared.
+    KRENDER_CLEAR_MODE_EPOCH
+};
+
+// Ways of projecting vertices onto the screen.
+enum
+{
+    // Divide by each vertex's perspective divisor. The reference.
+    KRENDER_PROJECTION_DIVIDE,
+
+    // Multiply by the divisor's reciprocal, looked up from a table of one
+    // reciprocal per whole-number depth in floating point or 16.16 fixed
+    // point. Rounding may put a vertex a pixel off from the reference.
+    KRENDER_PROJECTION_RECIPROCAL_FLOAT,
+    KRENDER_PROJECTION_RECIPROCAL_FIXED
+};
+
+// Instruction sets that the span kernels can use.
+enum
+{
+    KRENDER_ISA_SCALAR,
+    KRENDER_ISA_SSE2,
+    KRENDER_ISA_AVX2
+};
+
 // Places the display in VGA video mode 13h. Returns true on success; false
 // otherwise.
 int krender_enter_grapics_mode(void);
 
+// A function to receive finished frames from krender_flip_surface(). The pixels
+// are palette indices, width * height of them in row-major order; palette maps
+// each index to an 8-bit RGB triplet (it's NULL in DOS, where the palette lives
+// in the VGA hardware). The data are valid only for the duration of the call.
+typedef void (*krender_frame_sink_t)(const uint8_t *const pixels,
+                                     const unsigned width,
+                                     const unsigned height,
+                                     const uint8_t (*const palette)[3],
+                                     void *const userData);
+
 // Copies the current contents of the render buffer onto the display (e.g.
-// into video memory in DOS).
+// into video memory in DOS). If a frame sink has been set, the frame will also
+// be passed to it. In headless builds (RENDER_HEADLESS), there's no display and
+// the sink is the only recipient of the frame. Only the scanlines that differ
+// from the previous frame's are copied onto the display.
 void krender_flip_surface(void);
 
+// For use by frame sinks: returns true if the given scanline of the frame being
+// passed to the sink differs from the one in the previous frame that was. All
+// scanlines count as changed in the first frame passed to a newly set sink.
+int krender_row_changed(const unsigned y);
+
+// Sets the function to which krender_flip_surface() will pass each finished
+// frame, along with the given user data pointer. Pass NULL to remove the sink.
+void krender_set_frame_sink(krender_frame_sink_t sink, void *const userData);
+
 // Apply the given Rally-Sport palette.
 void krender_use_palette(const unsigned paletteIdx);
 
+// Writes Rally-Sport's palettes into the asset cache being baked.
+void krender_bake_palettes(void);
+
 // Places the display a text-compatible VGA video mode. Returns true on success;
 // false otherwise.
 int krender_enter_text_mode(void);
 
-// Wipes the screen to blank.
+// Wipes the screen to blank. In the buffered depth mode, also resets the depth
+// buffer. Depending on the clear mode (see krender_set_clear_mode()), some of
+// this work may be deferred until the frame is drawn.
 void krender_clear_surface(void);
 
+// Sets how polygons are ordered in depth (KRENDER_DEPTH_MODE_x). Any polygons
+// queued under the previous mode are flushed first. Defaults to
+// KRENDER_DEPTH_MODE_BUFFER.
+void krender_set_depth_mode(const unsigned depthMode);
+
+// Sets how krender_clear_surface() clears the render and depth buffers
+// (KRENDER_CLEAR_MODE_x). The output is the same in every mode. In the
+// painter's depth mode, the render buffer is always cleared in full. Defaults
+// to KRENDER_CLEAR_MODE_FULL.
+void krender_set_clear_mode(const unsigned clearMode);
+
+// Fills any polygons whose filling has been deferred, e.g. by the painter's
+// depth mode or for multithreaded filling. Called automatically by
+// krender_flip_surface().
+void krender_flush(void);
+
 // Renders the given mesh. If doTransform is true, the mesh's vertices will be
 // transformed into screen space prior to rendering; otherwise, transformation
-// will not be performed.
+// will not be performed. In the painter's depth mode, and when filling with
+// multiple threads, the polygons are queued to be filled at the next flush.
 void krender_draw_mesh(const struct mesh_s *const mesh, const int doTransform);
 
 // Prepare the render surface for drawing. In DOS, this means entering VGA mode
@@ -52,9 +176,33 @@ float krender_camera_x(void);
 
 float krender_camera_z(void);
 
+// Sets how vertices are projected onto the screen (KRENDER_PROJECTION_x).
+// Defaults to KRENDER_PROJECTION_DIVIDE.
+void krender_set_projection(const unsigned projection);
+
 // Transforms the given polygon into screen space.
 void krender_transform_poly(struct polygon_s *const poly);
 
 unsigned krender_current_video_mode(void);
 
+// Returns the render statistics accumulated since the last call to
+// krender_reset_stats().
+const struct krender_stats_s* krender_stats(void);
+
+void krender_reset_stats(void);
+
+// Allows or disallows filling polygons with SIMD span kernels. When allowed
+// (the default), the widest kernels the CPU supports will be used. The output
+// is the same either way. Disallowing also has krender_flip_surface() convert
+// the frame into RGB with a plain reference loop. Returns the instruction set
+// (KRENDER_ISA_x) the span kernels will now be using.
+unsigned krender_use_simd(const int allowSimd);
+
+// Sets how many threads, including the calling thread, fill polygons. With more
+// than one, the frame's polygons are queued and, at the next flush, filled in
+// horizontal bands of the screen in parallel; the output is the same as with a
+// single thread. Any queued polygons are flushed first. Returns the number of
+// threads now in use, which is always 1 in DOS. Defaults to 1.
+unsigned krender_set_thread_count(const unsigned numThreads);
+
 #endif
@@ -0,0 +1,216 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ * Span kernels: the innermost loops of polygon filling, each specialized for
+ * one fill mode so that the per-pixel work is free of mode checks. The kernels
+ * are handed spans that have already been clipped to the screen.
+ * 
+ * NOTE: This file expects to be #included in renderer.c.
+ * 
+ */
+
+// A horizontal run of pixels to be filled, with everything the kernels need
+// to know about it.
+struct span_s
+{
+    // The first pixel of the span in the render and depth buffers. The depth
+    // pointer isn't used by kernels that don't do depth testing.
+    uint8_t *pixels;
+    uint8_t *depth;
+
+    // The number of pixels in the span.
+    unsigned width;
+
+    // The depth value to test against and write into the depth buffer.
+    uint8_t polyDepth;
+
+    // The solid fill color, as a palette index; for untextured polygons.
+    uint8_t color;
+
+    // The row of texels to sample from, and the 8.8 fixed-point horizontal
+    // texture coordinate of the span's first pixel and its per-pixel increment;
+    // for textured polygons.
+    const uint8_t *texels;
+    uint16_t u;
+    uint16_t deltaU;
+};
+
+typedef void (*span_kernel_t)(const struct span_s *const span);
+
+enum
+{
+    SPAN_KERNEL_FLAT,
+    SPAN_KERNEL_TEXTURED,
+    SPAN_KERNEL_TEXTURED_ALPHA,
+
+    // As above, but without depth testing.
+    SPAN_KERNEL_FLAT_NO_DEPTH,
+    SPAN_KERNEL_TEXTURED_NO_DEPTH,
+    SPAN_KERNEL_TEXTURED_ALPHA_NO_DEPTH,
+
+    // Must be the last item in the list.
+    SPAN_KERNEL_COUNT
+};
+
+// The kernel to use for each fill mode. By default, these are the scalar
+// kernels below; init_span_kernels() in spansimd.c may swap in SIMD versions.
+static span_kernel_t SPAN_KERNELS[SPAN_KERNEL_COUNT];
+
+// The instruction set (KRENDER_ISA_x) of the kernels in SPAN_KERNELS.
+static unsigned SPAN_KERNEL_ISA = KRENDER_ISA_SCALAR;
+
+// Fills the span with the polygon's solid color.
+static void span_kernel_flat(const struct span_s *const span)
+{
+    uint8_t *const pixels = span->pixels;
+    uint8_t *const depth = span->depth;
+    const uint8_t polyDepth = span->polyDepth;
+    const uint8_t color = span->color;
+
+    for (unsigned i = 0; i < span->width; i++)
+    {
+        if (depth[i] < polyDepth)
+        {
+            pixels[i] = color;
+            depth[i] = polyDepth;
+        }
+    }
+
+    return;
+}
+
+// Fills the span with texels, all of which are drawn.
+static void span_kernel_textured(const struct span_s *const span)
+{
+    uint8_t *const pixels = span->pixels;
+    uint8_t *const depth = span->depth;
+    const uint8_t *const texels = span->texels;
+    const uint8_t polyDepth = span->polyDepth;
+    const uint16_t deltaU = span->deltaU;
+    uint16_t u = span->u;
+
+    for (unsigned i = 0; i < span->width; i++, u += deltaU)
+    {
+        if (depth[i] < polyDepth)
+        {
+            pixels[i] = texels[u >> 8];
+            depth[i] = polyDepth;
+        }
+    }
+
+    return;
+}
+
+// Fills the span with texels, skipping those with palette index 0.
+static void span_kernel_textured_alpha(const struct span_s *const span)
+{
+    uint8_t *const pixels = span->pixels;
+    uint8_t *const depth = span->depth;
+    const uint8_t *const texels = span->texels;
+    const uint8_t polyDepth = span->polyDepth;
+    const uint16_t deltaU = span->deltaU;
+    uint16_t u = span->u;
+
+    for (unsigned i = 0; i < span->width; i++, u += deltaU)
+    {
+        const uint8_t texel = texels[u >> 8];
+
+        if (texel && (depth[i] < polyDepth))
+        {
+            pixels[i] = texel;
+            depth[i] = polyDepth;
+        }
+    }
+
+    return;
+}
+
+// Fills the span with the polygon's solid color, without depth testing.
+static void span_kernel_flat_no_depth(const struct span_s *const span)
+{
+    memset(span->pixels, span->color, span->width);
+
+    return;
+}
+
+// Fills the span with texels, all of which are drawn, without depth testing.
+static void span_kernel_textured_no_depth(const struct span_s *const span)
+{
+    uint8_t *const pixels = span->pixels;
+    const uint8_t *const texels = span->texels;
+    const uint16_t deltaU = span->deltaU;
+    uint16_t u = span->u;
+
+    for (unsigned i = 0; i < span->width; i++, u += deltaU)
+    {
+        pixels[i] = texels[u >> 8];
+    }
+
+    return;
+}
+
+// Fills the span with texels, skipping those with palette index 0, without
+// depth testing.
+static void span_kernel_textured_alpha_no_depth(const struct span_s *const span)
+{
+    uint8_t *const pixels = span->pixels;
+    const uint8_t *const texels = span->texels;
+    const uint16_t deltaU = span->deltaU;
+    uint16_t u = span->u;
+
+    for (unsigned i = 0; i < span->width; i++, u += deltaU)
+    {
+        const uint8_t texel = texels[u >> 8];
+
+        if (texel)
+        {
+            pixels[i] = texel;
+        }
+    }
+
+    return;
+}
+
+// Counts the given polygon's fill mode in the render statistics. Called once for
+// each polygon submitted for filling, however many calls to fill_poly() the
+// filling is split into.
+static void count_poly_fill(const struct polygon_s *const poly)
+{
+    if (!poly->texture)
+    {
+        RENDER_STATS.numFlatPolys++;
+    }
+    else if (poly->texture->hasAlpha)
+    {
+        RENDER_STATS.numAlphaTexturedPolys++;
+    }
+    else
+    {
+        RENDER_STATS.numTexturedPolys++;
+    }
+
+    return;
+}
+
+// Returns the span kernel suited for filling the given polygon with or without
+// depth testing.
+static span_kernel_t select_span_kernel(const struct polygon_s *const poly, const int depthTest)
+{
+    // The no-depth kernels follow the depth-tested ones in the same order.
+    const unsigned depthOffset = (depthTest? 0 : SPAN_KERNEL_FLAT_NO_DEPTH);
+
+    if (!poly->texture)
+    {
+        return SPAN_KERNELS[SPAN_KERNEL_FLAT + depthOffset];
+    }
+    else if (poly->texture->hasAlpha)
+    {
+        return SPAN_KERNELS[SPAN_KERNEL_TEXTURED_ALPHA + depthOffset];
+    }
+    else
+    {
+        return SPAN_KERNELS[SPAN_KERNEL_TEXTURED + depthOffset];
+    }
+}
@@ -0,0 +1,350 @@
+/*
+ * 2020 Tarpeeksi Hyvae Soft
+ * 
+ * Software: Render test for replicating Rally-Sport's rendering.
+ * 
+ * SSE2 and AVX2 versions of the depth-tested span kernels in spanfill.c, chosen
+ * at run-time according to what the CPU supports. Since a polygon has a single
+ * depth value, the depth test is a comparison of a constant against a run of
+ * bytes, which we do 16 or 32 pixels at a time, blending the results into the
+ * render and depth buffers. Texels are gathered into a temporary vector with
+ * the same 8.8 stepping as in the scalar kernels, and leftover pixels at the
+ * end of a span are handed to the narrower kernels, so the output is
+ * bit-identical to theirs.
+ * 
+ * NOTE: This file expects to be #included in renderer.c, after spanfill.c.
+ * 
+ */
+
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !MSDOS)
+    #define SPAN_SIMD 1
+#else
+    #define SPAN_SIMD 0
+#endif
+
+#if SPAN_SIMD
+
+#include <immintrin.h>
+
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+
+// Returns a copy of the span with its first 'numDone' pixels removed, for
+// passing the remainder of a span to a scalar kernel.
+static struct span_s span_remainder(const struct span_s *const span, const unsigned numDone)
+{
+    struct span_s rest = *span;
+
+    rest.pixels += numDone;
+    rest.depth += numDone;
+    rest.width -= numDone;
+    rest.u += (uint16_t)(numDone * span->deltaU);
+
+    return rest;
+}
+
+// Copies the next 'count' texels along the span into dst, starting from texture
+// coordinate u. Returns the texture coordinate following the last texel.
+static uint16_t gather_texels(uint8_t *const dst,
+                              const unsigned count,
+                              const uint8_t *const texels,
+                              uint16_t u,
+                              const uint16_t deltaU)
+{
+    for (unsigned i = 0; i < count; i++, u += deltaU)
+    {
+        dst[i] = texels[u >> 8];
+    }
+
+    return u;
+}
+
+SIMD_TARGET("sse2") static void span_kernel_flat_sse2(const struct span_s *const span)
+{
+    // Spans too narrow for a full vector go straight to the narrower kernel.
+    if (span->width < 16)
+    {
+        span_kernel_flat(span);
+        return;
+    }
+
+    const __m128i polyDepth = _mm_set1_epi8((char)span->polyDepth);
+    const __m128i color = _mm_set1_epi8((char)span->color);
+    unsigned i = 0;
+
+    for (; (i + 16) <= span->width; i += 16)
+    {
+        __m128i *const pixels = (__m128i*)(span->pixels + i);
+        __m128i *const depth = (__m128i*)(span->depth + i);
+
+        // The depth test passes where the buffer's value is below the
+        // polygon's, in which case the new depth is the polygon's; so the new
+        // depth is the larger of the two, and the pixels that pass are those
+        // whose depth changes.
+        const __m128i oldDepth = _mm_loadu_si128(depth);
+        const __m128i newDepth = _mm_max_epu8(oldDepth, polyDepth);
+        const __m128i fail = _mm_cmpeq_epi8(newDepth, oldDepth);
+        const __m128i oldPixels = _mm_loadu_si128(pixels);
+
+        _mm_storeu_si128(pixels, _mm_or_si128(_mm_and_si128(fail, oldPixels), _mm_andnot_si128(fail, color)));
+        _mm_storeu_si128(depth, newDepth);
+    }
+
+    if (i < span->width)
+    {
+        const struct span_s rest = span_remainder(span, i);
+        span_kernel_flat(&rest);
+    }
+
+    return;
+}
+
+SIMD_TARGET("sse2") static void span_kernel_textured_sse2(const struct span_s *const span)
+{
+    // Spans too narrow for a full vector go straight to the narrower kernel.
+    if (span->width < 16)
+    {
+        span_kernel_textured(span);
+        return;
+    }
+
+    const __m128i polyDepth = _mm_set1_epi8((char)span->polyDepth);
+    uint8_t texelBuffer[16];
+    uint16_t u = span->u;
+    unsigned i = 0;
+
+    for (; (i + 16) <= span->width; i += 16)
+    {
+        __m128i *const pixels = (__m128i*)(span->pixels + i);
+        __m128i *const depth = (__m128i*)(span->depth + i);
+
+        u = gather_texels(texelBuffer, 16, span->texels, u, span->deltaU);
+
+        const __m128i texels = _mm_loadu_si128((const __m128i*)texelBuffer);
+        const __m128i oldDepth = _mm_loadu_si128(depth);
+        const __m128i newDepth = _mm_max_epu8(oldDepth, polyDepth);
+        const __m128i fail = _mm_cmpeq_epi8(newDepth, oldDepth);
+        const __m128i oldPixels = _mm_loadu_si128(pixels);
+
+        _mm_storeu_si128(pixels, _mm_or_si128(_mm_and_si128(fail, oldPixels), _mm_andnot_si128(fail, texels)));
+        _mm_storeu_si128(depth, newDepth);
+    }
+
+    if (i < span->width)
+    {
+        const struct span_s rest = span_remainder(span, i);
+        span_kernel_textured(&rest);
+    }
+
+    return;
+}
+
+SIMD_TARGET("sse2") static void span_kernel_textured_alpha_sse2(const struct span_s *const span)
+{
+    // Spans too narrow for a full vector go straight to the narrower kernel.
+    if (span->width < 16)
+    {
+        span_kernel_textured_alpha(span);
+        return;
+    }
+
+    const __m128i polyDepth = _mm_set1_epi8((char)span->polyDepth);
+    const __m128i zero = _mm_setzero_si128();
+    uint8_t texelBuffer[16];
+    uint16_t u = span->u;
+    unsigned i = 0;
+
+    for (; (i + 16) <= span->width; i += 16)
+    {
+        __m128i *const pixels = (__m128i*)(span->pixels + i);
+        __m128i *const depth = (__m128i*)(span->depth + i);
+
+        u = gather_texels(texelBuffer, 16, span->texels, u, span->deltaU);
+
+        // Pixels fail if they fail the depth test or the alpha test.
+        const __m128i texels = _mm_loadu_si128((const __m128i*)texelBuffer);
+        const __m128i oldDepth = _mm_loadu_si128(depth);
+        const __m128i fail = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(oldDepth, polyDepth), oldDepth),
+                                          _mm_cmpeq_epi8(texels, zero));
+        const __m128i oldPixels = _mm_loadu_si128(pixels);
+
+        _mm_storeu_si128(pixels, _mm_or_si128(_mm_and_si128(fail, oldPixels), _mm_andnot_si128(fail, texels)));
+        _mm_storeu_si128(depth, _mm_or_si128(_mm_and_si128(fail, oldDepth), _mm_andnot_si128(fail, polyDepth)));
+    }
+
+    if (i < span->width)
+    {
+        const struct span_s rest = span_remainder(span, i);
+        span_kernel_textured_alpha(&rest);
+    }
+
+    return;
+}
+
+SIMD_TARGET("avx2") static void span_kernel_flat_avx2(const struct span_s *const span)
+{
+    // Spans too narrow for a full vector go straight to the narrower kernel.
+    if (span->width < 32)
+    {
+        span_kernel_flat_sse2(span);
+        return;
+    }
+
+    const __m256i polyDepth = _mm256_set1_epi8((char)span->polyDepth);
+    const __m256i color = _mm256_set1_epi8((char)span->color);
+    unsigned i = 0;
+
+    for (; (i + 32) <= span->width; i += 32)
+    {
+        __m256i *const pixels = (__m256i*)(span->pixels + i);
+        __m256i *const depth = (__m256i*)(span->depth + i);
+
+        const __m256i oldDepth = _mm256_loadu_si256(depth);
+        const __m256i newDepth = _mm256_max_epu8(oldDepth, polyDepth);
+        const __m256i fail = _mm256_cmpeq_epi8(newDepth, oldDepth);
+
+        _mm256_storeu_si256(pixels, _mm256_blendv_epi8(color, _mm256_loadu_si256(pixels), fail));
+        _mm256_storeu_si256(depth, newDepth);
+    }
+
+    // Clear the upper halves of the vector registers, so that the SSE code
+    // that may follow doesn't pay for an AVX-to-SSE state transition.
+    _mm256_zeroupper();
+
+    if (i < span->width)
+    {
+        const struct span_s rest = span_remainder(span, i);
+        span_kernel_flat_sse2(&rest);
+    }
+
+    return;
+}
+
+SIMD_TARGET("avx2") static void span_kernel_textured_avx2(const struct span_s *const span)
+{
+    // Spans too narrow for a full vector go straight to the narrower kernel.
+    if (span->width < 32)
+    {
+        span_kernel_textured_sse2(span);
+        return;
+    }
+
+    const __m256i polyDepth = _mm256_set1_epi8((char)span->polyDepth);
+    uint8_t texelBuffer[32];
+    uint16_t u = span->u;
+    unsigned i = 0;
+
+    for (; (i + 32) <= span->width; i += 32)
+    {
+        __m256i *const pixels = (__m256i*)(span->pixels + i);
+        __m256i *const depth = (__m256i*)(span->depth + i);
+
+        u = gather_texels(texelBuffer, 32, span->texels, u, span->deltaU);
+
+        const __m256i texels = _mm256_loadu_si256((const __m256i*)texelBuffer);
+        const __m256i oldDepth = _mm256_loadu_si256(depth);
+        const __m256i newDepth = _mm256_max_epu8(oldDepth, polyDepth);
+        const __m256i fail = _mm256_cmpeq_epi8(newDepth, oldDepth);
+
+        _mm256_storeu_si256(pixels, _mm256_blendv_epi8(texels, _mm256_loadu_si256(pixels), fail));
+        _mm256_storeu_si256(depth, newDepth);
+    }
+
+    // Clear the upper halves of the vector registers, so that the SSE code
+    // that may follow doesn't pay for an AVX-to-SSE state transition.
+    _mm256_zeroupper();
+
+    if (i < span->width)
+    {
+        const struct span_s rest = span_remainder(span, i);
+        span_kernel_textured_sse2(&rest);
+    }
+
+    return;
+}
+
+SIMD_TARGET("avx2") static void span_kernel_textured_alpha_avx2(const struct span_s *const span)
+{
+    // Spans too narrow for a full vector go straight to the narrower kernel.
+    if (span->width < 32)
+    {
+        span_kernel_textured_alpha_sse2(span);
+        return;
+    }
+
+    const __m256i polyDepth = _mm256_set1_epi8((char)span->polyDepth);
+    const __m256i zero = _mm256_setzero_si256();
+    uint8_t texelBuffer[32];
+    uint16_t u = span->u;
+    unsigned i = 0;
+
+    for (; (i + 32) <= span->width; i += 32)
+    {
+        __m256i *const pixels = (__m256i*)(span->pixels + i);
+        __m256i *const depth = (__m256i*)(span->depth + i);
+
+        u = gather_texels(texelBuffer, 32, span->texels, u, span->deltaU);
+
+        const __m256i texels = _mm256_loadu_si256((const __m256i*)texelBuffer);
+        const __m256i oldDepth = _mm256_loadu_si256(depth);
+        const __m256i fail = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(oldDepth, polyDepth), oldDepth),
+                                             _mm256_cmpeq_epi8(texels, zero));
+
+        _mm256_storeu_si256(pixels, _mm256_blendv_epi8(texels, _mm256_loadu_si256(pixels), fail));
+        _mm256_storeu_si256(depth, _mm256_blendv_epi8(polyDepth, oldDepth, fail));
+    }
+
+    // Clear the upper halves of the vector registers, so that the SSE code
+    // that may follow doesn't pay for an AVX-to-SSE state transition.
+    _mm256_zeroupper();
+
+    if (i < span->width)
+    {
+        const struct span_s rest = span_remainder(span, i);
+        span_kernel_textured_alpha_sse2(&rest);
+    }
+
+    return;
+}
+
+#endif
+
+// Points the span kernel table at the widest kernels that both the CPU and the
+// caller allow.
+static void init_span_kernels(const int allowSimd)
+{
+    SPAN_KERNELS[SPAN_KERNEL_FLAT] = span_kernel_flat;
+    SPAN_KERNELS[SPAN_KERNEL_TEXTURED] = span_kernel_textured;
+    SPAN_KERNELS[SPAN_KERNEL_TEXTURED_ALPHA] = span_kernel_textured_alpha;
+    SPAN_KERNELS[SPAN_KERNEL_FLAT_NO_DEPTH] = span_kernel_flat_no_depth;
+    SPAN_KERNELS[SPAN_KERNEL_TEXTURED_NO_DEPTH] = span_kernel_textured_no_depth;
+    SPAN_KERNELS[SPAN_KERNEL_TEXTURED_ALPHA_NO_DEPTH] = span_kernel_textured_alpha_no_depth;
+    SPAN_KERNEL_ISA = KRENDER_ISA_SCALAR;
+
+    #if SPAN_SIMD
+        if (!allowSimd)
+        {
+            return;
+        }
+
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+        {
+            SPAN_KERNELS[SPAN_KERNEL_FLAT] = span_kernel_flat_avx2;
+            SPAN_KERNELS[SPAN_KERNEL_TEXTURED] = span_kernel_textured_avx2;
+            SPAN_KERNELS[SPAN_KERNEL_TEXTURED_ALPHA] = span_kernel_textured_alpha_avx2;
+            SPAN_KERNEL_ISA = KRENDER_ISA_AVX2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            SPAN_KERNELS[SPAN_KERNEL_FLAT] = span_kernel_flat_sse2;
+            SPAN_KERNELS[SPAN_KERNEL_TEXTURED] = span_kernel_textured_sse2;
+            SPAN_KERNELS[SPAN_KERNEL_TEXTURED_ALPHA] = span_kernel_textured_alpha_sse2;
+            SPAN_KERNEL_ISA = KRENDER_ISA_SSE2;
+        }
+    #else
+        (void)allowSimd;
+    #endif
+
+    return;
+}